@@ -19,6 +19,8 @@
  *
  */
 
+#include <libpurple/eventloop.h>
+
 #include <telepathy-glib/channel-iface.h>
 #include <telepathy-glib/dbus.h>
 #include <telepathy-glib/exportable-channel.h>
@@ -454,7 +456,7 @@ haze_chat_channel_set_chat_state (TpSvcChannelInterfaceChatState *self,
     if (ui_data->resend_typing_timeout_id)
     {
         DEBUG ("clearing existing resend_typing_cb timeout");
-        g_source_remove (ui_data->resend_typing_timeout_id);
+        purple_timeout_remove (ui_data->resend_typing_timeout_id);
         ui_data->resend_typing_timeout_id = 0;
     }
 
@@ -502,8 +504,8 @@ haze_chat_channel_set_chat_state (TpSvcChannelInterfaceChatState *self,
      */
     if (timeout && typing != PURPLE_NOT_TYPING)
     {
-        ui_data->resend_typing_timeout_id = g_timeout_add (timeout * 1000,
-            resend_typing_cb, conv);
+        ui_data->resend_typing_timeout_id = purple_timeout_add_seconds (
+            timeout, resend_typing_cb, conv);
     }
 
     tp_svc_channel_interface_chat_state_return_from_set_chat_state (context);
@@ -334,16 +334,21 @@ blist_node_aliased_cb (PurpleBlistNode *node,
     TpBaseConnection *base_conn;
     GPtrArray *aliases;
     TpHandle handle;
-    TpHandleRepoIface *contact_handles;
 
     if (!PURPLE_BLIST_NODE_IS_BUDDY (node))
         return;
 
     buddy = (PurpleBuddy *)node;
+
+    if (buddy->account->ui_data == NULL)
+        return;
+
     base_conn = ACCOUNT_GET_TP_BASE_CONNECTION (buddy->account);
-    contact_handles =
-        tp_base_connection_get_handles (base_conn, TP_HANDLE_TYPE_CONTACT);
-    handle = tp_handle_ensure (contact_handles, buddy->name, NULL, NULL);
+    handle = haze_connection_get_buddy_handle (HAZE_CONNECTION (base_conn),
+        buddy);
+
+    if (G_UNLIKELY (handle == 0))
+        return;
 
     aliases = g_ptr_array_sized_new (1);
     g_ptr_array_add (aliases, tp_value_array_build (2,
@@ -177,25 +177,21 @@ haze_connection_get_avatar_requirements (TpSvcConnectionInterfaceAvatars *self,
         icon_spec->max_filesize);
 }
 
-static GArray *
-get_avatar (HazeConnection *conn,
-            TpHandle handle)
+/* Returns a new reference to @handle's icon, which is a PurpleStoredImage
+ * if @handle is the self handle and a PurpleBuddyIcon otherwise, or %NULL if
+ * it has none. */
+static gpointer
+dup_icon (HazeConnection *conn,
+          TpHandle handle)
 {
-    GArray *avatar = NULL;
     TpBaseConnection *base = TP_BASE_CONNECTION (conn);
     TpHandleRepoIface *contact_handles =
         tp_base_connection_get_handles (base, TP_HANDLE_TYPE_CONTACT);
-    gconstpointer icon_data = NULL;
-    size_t icon_size = 0;
+
     if (handle == base->self_handle)
     {
-        PurpleStoredImage *image =
-            purple_buddy_icons_find_account_icon (conn->account);
-        if (image)
-        {
-            icon_data = purple_imgstore_get_data (image);
-            icon_size = purple_imgstore_get_size (image);
-        }
+        /* This returns a new reference */
+        return purple_buddy_icons_find_account_icon (conn->account);
     }
     else
     {
@@ -205,8 +201,54 @@ get_avatar (HazeConnection *conn,
         if (buddy)
             icon = purple_buddy_get_icon (buddy);
         if (icon)
-            icon_data = purple_buddy_icon_get_data (icon, &icon_size);
+            return purple_buddy_icon_ref (icon);
+    }
+
+    return NULL;
+}
+
+static void
+icon_unref (gpointer icon,
+            gboolean self)
+{
+    if (icon == NULL)
+        return;
+
+    if (self)
+        purple_imgstore_unref (icon);
+    else
+        purple_buddy_icon_unref (icon);
+}
+
+/* Returns @icon's data, which is valid as long as @icon is. */
+static gconstpointer
+icon_get_data (gpointer icon,
+               gboolean self,
+               size_t *icon_size)
+{
+    if (self)
+    {
+        *icon_size = purple_imgstore_get_size (icon);
+        return purple_imgstore_get_data (icon);
+    }
+    else
+    {
+        return purple_buddy_icon_get_data (icon, icon_size);
     }
+}
+
+static GArray *
+get_avatar (HazeConnection *conn,
+            TpHandle handle)
+{
+    GArray *avatar = NULL;
+    gboolean self = (handle == TP_BASE_CONNECTION (conn)->self_handle);
+    gpointer icon = dup_icon (conn, handle);
+    gconstpointer icon_data = NULL;
+    size_t icon_size = 0;
+
+    if (icon != NULL)
+        icon_data = icon_get_data (icon, self, &icon_size);
 
     if (icon_data)
     {
@@ -214,18 +256,20 @@ get_avatar (HazeConnection *conn,
         g_array_append_vals (avatar, icon_data, icon_size);
     }
 
+    icon_unref (icon, self);
     return avatar;
 }
 
 static gchar *
-get_token (const GArray *avatar)
+get_token (gconstpointer icon_data,
+           size_t icon_size)
 {
     gchar *token;
 
     PurpleCipherContext *context;
     gchar digest[41];
 
-    g_assert (avatar != NULL);
+    g_assert (icon_data != NULL);
 
     context = purple_cipher_context_new_by_name ("sha1", NULL);
     if (context == NULL)
@@ -234,8 +278,7 @@ get_token (const GArray *avatar)
     }
 
     /* Hash the image data */
-    purple_cipher_context_append (context, (const guchar *) avatar->data,
-            avatar->len);
+    purple_cipher_context_append (context, icon_data, icon_size);
     if (!purple_cipher_context_digest_to_str (context, sizeof (digest),
                 digest, NULL))
     {
@@ -248,24 +291,94 @@ get_token (const GArray *avatar)
     return token;
 }
 
-static gchar *
-get_handle_token (HazeConnection *conn,
-                  TpHandle handle)
-{
-    GArray *avatar = get_avatar (conn, handle);
+/* Hashing every contact's icon whenever a client asks for their attributes
+ * is expensive, so each contact's token is remembered, together with a
+ * reference to the icon it was computed from. The entry is thrown away when
+ * libpurple says the icon has changed, or the contact's buddy is removed;
+ * checking that libpurple still has the same icon guards against changes it
+ * doesn't tell us about. Holding the reference means the icon can't be
+ * freed and another allocated in its place.
+ */
+typedef struct {
+    /* See dup_icon() */
+    gpointer icon;
+    gboolean self;
     gchar *token;
+} AvatarToken;
+
+static void
+avatar_token_free (gpointer p)
+{
+    AvatarToken *t = p;
+
+    icon_unref (t->icon, t->self);
+    g_free (t->token);
+    g_slice_free (AvatarToken, t);
+}
 
-    if (avatar != NULL)
+static void
+forget_handle_token (HazeConnection *conn,
+                     TpHandle handle)
+{
+    if (conn->avatar_tokens != NULL)
+        g_hash_table_remove (conn->avatar_tokens, GUINT_TO_POINTER (handle));
+}
+
+/* Returns @handle's token, which is "" if it has no avatar. The token is
+ * only valid until @handle's avatar changes. */
+static const gchar *
+peek_handle_token (HazeConnection *conn,
+                   TpHandle handle)
+{
+    AvatarToken *t = g_hash_table_lookup (conn->avatar_tokens,
+        GUINT_TO_POINTER (handle));
+    gpointer icon = dup_icon (conn, handle);
+    gboolean self = (handle == TP_BASE_CONNECTION (conn)->self_handle);
+    gconstpointer icon_data = NULL;
+    size_t icon_size = 0;
+
+    if (t != NULL && t->icon == icon)
     {
-        token = get_token (avatar);
-        g_array_free (avatar, TRUE);
+        icon_unref (icon, self);
+        return t->token;
     }
+
+    t = g_slice_new0 (AvatarToken);
+    t->icon = icon;
+    t->self = self;
+
+    if (icon != NULL)
+        icon_data = icon_get_data (icon, self, &icon_size);
+
+    if (icon_data != NULL)
+        t->token = get_token (icon_data, icon_size);
     else
-    {
-        token = g_strdup ("");
-    }
+        t->token = g_strdup ("");
 
-    return token;
+    g_hash_table_insert (conn->avatar_tokens, GUINT_TO_POINTER (handle), t);
+    return t->token;
+}
+
+/**
+ * haze_connection_avatars_forget_contact:
+ * @object: a connection
+ * @handle: a contact one of whose buddies is being removed
+ *
+ * Forgets @handle's avatar token, so that it is computed again if the contact
+ * comes back.
+ */
+void
+haze_connection_avatars_forget_contact (GObject *object,
+                                        TpHandle handle)
+{
+    forget_handle_token (HAZE_CONNECTION (object), handle);
+}
+
+static gchar *
+get_handle_token (HazeConnection *conn,
+                  TpHandle handle)
+{
+    return g_strdup (peek_handle_token (conn, handle));
 }
 
 static void
@@ -331,18 +444,12 @@ haze_connection_get_known_avatar_tokens (TpSvcConnectionInterfaceAvatars *self,
          * avatar you last used.  So we special-case self_handle here.
          */
 
-        if (handle == base_conn->self_handle)
-        {
-            GArray *avatar = get_avatar (conn, handle);
-            if (avatar != NULL)
-            {
-                token = get_token (avatar);
-                g_array_free (avatar, TRUE);
-            }
-        }
-        else
+        token = get_handle_token (conn, handle);
+
+        if (handle == base_conn->self_handle && *token == '\0')
         {
-            token = get_handle_token (conn, handle);
+            g_free (token);
+            token = NULL;
         }
 
         if (token != NULL)
@@ -405,10 +512,9 @@ haze_connection_request_avatars (TpSvcConnectionInterfaceAvatars *self,
         GArray *avatar = get_avatar (conn, handle);
         if (avatar != NULL)
         {
-            gchar *token = get_token (avatar);
             tp_svc_connection_interface_avatars_emit_avatar_retrieved (
-                conn, handle, token, avatar, "" /* unknown MIME type */);
-            g_free (token);
+                conn, handle, peek_handle_token (conn, handle), avatar,
+                "" /* unknown MIME type */);
             g_array_free (avatar, TRUE);
         }
     }
@@ -425,6 +531,7 @@ haze_connection_clear_avatar (TpSvcConnectionInterfaceAvatars *self,
     PurpleAccount *account = conn->account;
 
     purple_buddy_icons_set_account_icon (account, NULL, 0);
+    forget_handle_token (conn, base_conn->self_handle);
 
     tp_svc_connection_interface_avatars_return_from_clear_avatar (context);
     tp_svc_connection_interface_avatars_emit_avatar_updated (conn,
@@ -501,7 +608,8 @@ haze_connection_set_avatar (TpSvcConnectionInterfaceAvatars *self,
     icon_data = g_malloc (avatar->len);
     memcpy (icon_data, avatar->data, icon_len);
     purple_buddy_icons_set_account_icon (account, icon_data, icon_len);
-    token = get_token (avatar);
+    forget_handle_token (conn, base_conn->self_handle);
+    token = get_token (avatar->data, avatar->len);
     DEBUG ("%s", token);
 
     tp_svc_connection_interface_avatars_return_from_set_avatar (context, token);
@@ -533,15 +641,24 @@ static void
 buddy_icon_changed_cb (PurpleBuddy *buddy,
                        gpointer unused)
 {
-    HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (buddy->account);
-    TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
-    TpHandleRepoIface *contact_repo =
-        tp_base_connection_get_handles (base_conn, TP_HANDLE_TYPE_CONTACT);
+    HazeConnection *conn;
+    const char *bname = purple_buddy_get_name (buddy);
+    TpHandle contact;
+    gchar *token;
 
-    const char* bname = purple_buddy_get_name (buddy);
-    TpHandle contact = tp_handle_ensure (contact_repo, bname, NULL, NULL);
+    /* Icons may be loaded from the persistent cache for buddies of accounts
+     * with no connection yet. */
+    if (buddy->account->ui_data == NULL)
+        return;
 
-    gchar *token = get_handle_token (conn, contact);
+    conn = ACCOUNT_GET_HAZE_CONNECTION (buddy->account);
+    contact = haze_connection_get_buddy_handle (conn, buddy);
+
+    if (G_UNLIKELY (contact == 0))
+        return;
+
+    forget_handle_token (conn, contact);
+    token = get_handle_token (conn, contact);
 
     DEBUG ("%s '%s'", bname, token);
 
@@ -570,7 +687,7 @@ fill_contact_attributes (GObject *object,
     for (i = 0; i < contacts->len; i++)
     {
         TpHandle handle = g_array_index (contacts, guint, i);
-        gchar *token = get_handle_token (self, handle);
+        const gchar *token = peek_handle_token (self, handle);
         GValue *value = tp_g_value_slice_new (G_TYPE_STRING);
 
         g_assert (token != NULL);
@@ -585,7 +702,20 @@ fill_contact_attributes (GObject *object,
 void
 haze_connection_avatars_init (GObject *object)
 {
+    HazeConnection *conn = HAZE_CONNECTION (object);
+
+    conn->avatar_tokens = g_hash_table_new_full (NULL, NULL, NULL,
+        avatar_token_free);
+
     tp_contacts_mixin_add_contact_attributes_iface (object,
         TP_IFACE_CONNECTION_INTERFACE_AVATARS,
         fill_contact_attributes);
 }
+
+void
+haze_connection_avatars_finalize (GObject *object)
+{
+    HazeConnection *conn = HAZE_CONNECTION (object);
+
+    tp_clear_pointer (&conn->avatar_tokens, g_hash_table_unref);
+}
@@ -24,10 +24,14 @@
 
 #include <glib-object.h>
 #include <telepathy-glib/dbus-properties-mixin.h>
+#include <telepathy-glib/handle.h>
 
 void haze_connection_avatars_iface_init (gpointer g_iface, gpointer iface_data);
 void haze_connection_avatars_class_init (GObjectClass *object_class);
 void haze_connection_avatars_init (GObject *object);
+void haze_connection_avatars_finalize (GObject *object);
+void haze_connection_avatars_forget_contact (GObject *object,
+    TpHandle handle);
 
 extern TpDBusPropertiesMixinPropImpl *haze_connection_avatars_properties;
 void haze_connection_avatars_properties_getter (GObject *object,
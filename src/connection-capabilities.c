@@ -688,12 +688,17 @@ caps_changed_cb (PurpleBuddy *buddy,
                  PurpleMediaCaps oldcaps)
 {
   PurpleAccount *account = purple_buddy_get_account (buddy);
-  HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (account);
-  TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
-  TpHandleRepoIface *contact_repo =
-      tp_base_connection_get_handles (base_conn, TP_HANDLE_TYPE_CONTACT);
-  const gchar *bname = purple_buddy_get_name(buddy);
-  TpHandle contact = tp_handle_ensure (contact_repo, bname, NULL, NULL);
+  HazeConnection *conn;
+  TpHandle contact;
+
+  if (account->ui_data == NULL)
+    return;
+
+  conn = ACCOUNT_GET_HAZE_CONNECTION (account);
+  contact = haze_connection_get_buddy_handle (conn, buddy);
+
+  if (G_UNLIKELY (contact == 0))
+    return;
 
   _emit_capabilities_changed (conn, contact,
       purple_caps_to_tp_flags(oldcaps),
@@ -31,6 +31,7 @@
 
 #include "connection-manager.h"
 #include "debug.h"
+#include "trace.h"
 
 G_DEFINE_TYPE(HazeConnectionManager,
     haze_connection_manager,
@@ -56,12 +57,15 @@ _haze_cm_constructed (GObject *object)
       chain_up (object);
     }
 
-  for (protocols = haze_protocol_build_list ();
-      protocols != NULL;
-      protocols = g_list_delete_link (protocols, protocols))
+  haze_trace_begin ("haze_protocol_build_list");
+  protocols = haze_protocol_build_list ();
+  haze_trace_end ("haze_protocol_build_list");
+
+  while (protocols != NULL)
     {
       tp_base_connection_manager_add_protocol (base, protocols->data);
       g_object_unref (protocols->data);
+      protocols = g_list_delete_link (protocols, protocols);
     }
 }
 
@@ -75,6 +79,7 @@ _haze_cm_finalize (GObject *object)
 
     if (priv->debug_sender != NULL)
     {
+        haze_debug_set_sender (NULL);
         g_object_unref (priv->debug_sender);
         priv->debug_sender = NULL;
     }
@@ -111,6 +116,7 @@ haze_connection_manager_init (HazeConnectionManager *self)
     self->priv = priv;
 
     priv->debug_sender = tp_debug_sender_dup ();
+    haze_debug_set_sender (priv->debug_sender);
     g_log_set_default_handler (tp_debug_sender_log_handler, G_LOG_DOMAIN);
 
     DEBUG ("Initializing (HazeConnectionManager *)%p", self);
@@ -22,6 +22,8 @@
 #include "connection-presence.h"
 #include "debug.h"
 
+#include <stdlib.h>
+
 #include <telepathy-glib/dbus.h>
 
 static const TpPresenceStatusOptionalArgumentSpec arg_specs[] = {
@@ -78,21 +80,110 @@ static const HazeStatusIndex status_indices[] = {
     HAZE_STATUS_EXT_AWAY   /* PURPLE_STATUS_EXTENDED_AWAY */
 };
 
+/* Most contacts share a handful of statuses, so rather than stripping the
+ * markup from the same messages and building the same argument tables over
+ * and over, converted statuses are shared. Each is identified by its index
+ * and unstripped message, and the STATUS_CACHE_SIZE most recently used are
+ * kept for reuse. The presence mixin only reads the statuses it is given, so
+ * the same one can appear in any number of tables, which must release them
+ * with haze_status_unref().
+ */
+#define STATUS_CACHE_SIZE 256
+
+typedef struct _HazeStatus HazeStatus;
+struct _HazeStatus {
+    /* First, so that a HazeStatus can be used as a TpPresenceStatus */
+    TpPresenceStatus status;
+    /* The message before stripping markup, or NULL */
+    gchar *xhtml_message;
+    guint refcount;
+    /* In status_lru, if it's in status_cache */
+    GList link;
+};
+
+/* A set of HazeStatus, each holding a reference */
+static GHashTable *status_cache = NULL;
+/* Most recently used first */
+static GQueue status_lru = G_QUEUE_INIT;
+
+static guint
+haze_status_hash (gconstpointer key)
+{
+    const HazeStatus *hs = key;
+
+    if (hs->xhtml_message == NULL)
+        return hs->status.index;
+
+    return hs->status.index ^ g_str_hash (hs->xhtml_message);
+}
+
+static gboolean
+haze_status_equal (gconstpointer a,
+                   gconstpointer b)
+{
+    const HazeStatus *hs_a = a, *hs_b = b;
+
+    return (hs_a->status.index == hs_b->status.index &&
+        !tp_strdiff (hs_a->xhtml_message, hs_b->xhtml_message));
+}
+
+static HazeStatus *
+haze_status_ref (HazeStatus *hs)
+{
+    hs->refcount++;
+    return hs;
+}
+
+static void
+haze_status_unref (gpointer status)
+{
+    HazeStatus *hs = status;
+
+    if (--hs->refcount > 0)
+        return;
+
+    g_hash_table_unref (hs->status.optional_arguments);
+    g_free (hs->xhtml_message);
+    g_slice_free (HazeStatus, hs);
+}
+
+static HazeStatus *
+haze_status_new (guint status_ix,
+                 const gchar *xhtml_message)
+{
+    HazeStatus *hs = g_slice_new0 (HazeStatus);
+
+    hs->status.index = status_ix;
+    hs->status.optional_arguments = g_hash_table_new_full (g_str_hash,
+        g_str_equal, NULL, (GDestroyNotify) tp_g_value_slice_free);
+    hs->xhtml_message = g_strdup (xhtml_message);
+    hs->refcount = 1;
+    hs->link.data = hs;
+
+    if (xhtml_message != NULL)
+    {
+        gchar *message = purple_markup_strip_html (xhtml_message);
+
+        g_hash_table_insert (hs->status.optional_arguments, "message",
+            tp_g_value_slice_new_string (message));
+        g_free (message);
+    }
+
+    return hs;
+}
+
+/* Returns a status which must be released with haze_status_unref(). */
 static TpPresenceStatus *
 _get_tp_status (PurpleStatus *p_status)
 {
     PurpleStatusType *type;
     PurpleStatusPrimitive prim;
-    GHashTable *arguments = g_hash_table_new_full (g_str_hash, g_str_equal,
-        NULL, (GDestroyNotify) tp_g_value_slice_free);
-    guint status_ix = -1;
-    const gchar *xhtml_message;
-    gchar *message;
-    TpPresenceStatus *tp_status;
+    HazeStatus key = { { 0, NULL }, NULL, 0, { NULL, NULL, NULL } };
+    HazeStatus *hs;
 
     if (p_status == NULL)
     {
-        status_ix = HAZE_STATUS_UNKNOWN;
+        key.status.index = HAZE_STATUS_UNKNOWN;
     }
     else
     {
@@ -102,29 +193,45 @@ _get_tp_status (PurpleStatus *p_status)
         if (prim <= 0 || prim >= G_N_ELEMENTS (status_indices))
         {
             /* guess wildly rather than crashing */
-            status_ix = HAZE_STATUS_AVAILABLE;
+            key.status.index = HAZE_STATUS_AVAILABLE;
         }
         else
         {
-            status_ix = status_indices[prim];
+            key.status.index = status_indices[prim];
         }
 
-        xhtml_message = purple_status_get_attr_string (p_status, "message");
-        if (xhtml_message)
-        {
-            GValue *message_v = g_slice_new0 (GValue);
+        /* Borrowed for the lookup */
+        key.xhtml_message = (gchar *) purple_status_get_attr_string (p_status,
+            "message");
+    }
 
-            message = purple_markup_strip_html (xhtml_message);
-            g_value_init (message_v, G_TYPE_STRING);
-            g_value_set_string (message_v, message);
-            g_hash_table_insert (arguments, "message", message_v);
-            g_free (message);
-        }
+    if (status_cache == NULL)
+        status_cache = g_hash_table_new_full (haze_status_hash,
+            haze_status_equal, haze_status_unref, NULL);
+
+    hs = g_hash_table_lookup (status_cache, &key);
+
+    if (hs != NULL)
+    {
+        g_queue_unlink (&status_lru, &hs->link);
+        g_queue_push_head_link (&status_lru, &hs->link);
+        return (TpPresenceStatus *) haze_status_ref (hs);
     }
 
-    tp_status = tp_presence_status_new (status_ix, arguments);
-    g_hash_table_destroy (arguments);
-    return tp_status;
+    hs = haze_status_new (key.status.index, key.xhtml_message);
+
+    if (status_lru.length >= STATUS_CACHE_SIZE)
+    {
+        GList *oldest = g_queue_pop_tail_link (&status_lru);
+
+        /* Tables may still be using it */
+        g_hash_table_remove (status_cache, oldest->data);
+    }
+
+    g_hash_table_insert (status_cache, haze_status_ref (hs), hs);
+    g_queue_push_head_link (&status_lru, &hs->link);
+
+    return (TpPresenceStatus *) hs;
 }
 
 static const char *
@@ -160,13 +267,85 @@ _status_available (GObject *obj,
 }
 
 
+/* Finding a contact's status means inspecting its handle and looking up
+ * its buddy by name, which libpurple normalizes, so each contact's status is
+ * remembered in conn->presences until the presence signals say it has
+ * changed, or the contact's buddies do. */
+static TpPresenceStatus *
+status_array_peek (GPtrArray *arr,
+                   TpHandle handle)
+{
+    if (arr == NULL || handle >= arr->len)
+        return NULL;
+
+    return g_ptr_array_index (arr, handle);
+}
+
+/* Takes a reference to @tp_status, which may be %NULL to forget. */
+static void
+status_array_set (GPtrArray **arr,
+                  TpHandle handle,
+                  TpPresenceStatus *tp_status)
+{
+    gpointer *slot;
+
+    if (*arr == NULL)
+        *arr = g_ptr_array_new ();
+
+    if (handle >= (*arr)->len)
+    {
+        if (tp_status == NULL)
+            return;
+
+        g_ptr_array_set_size (*arr, handle + 1);
+    }
+
+    slot = &g_ptr_array_index (*arr, handle);
+
+    if (*slot != NULL)
+        haze_status_unref (*slot);
+
+    *slot = (tp_status != NULL ?
+        haze_status_ref ((HazeStatus *) tp_status) : NULL);
+}
+
+static void
+status_array_free (GPtrArray **arr)
+{
+    guint i;
+
+    if (*arr == NULL)
+        return;
+
+    for (i = 0; i < (*arr)->len; i++)
+    {
+        if (g_ptr_array_index (*arr, i) != NULL)
+            haze_status_unref (g_ptr_array_index (*arr, i));
+    }
+
+    g_ptr_array_free (*arr, TRUE);
+    *arr = NULL;
+}
+
+/* Whether a change to @handle's presence is being held back by
+ * damp_presence(), in which case clients should keep seeing the status they
+ * were last told about. */
+static gboolean
+presence_is_held (HazeConnection *conn,
+                  TpHandle handle)
+{
+    return (conn->held_presences != NULL &&
+        g_hash_table_lookup (conn->held_presences,
+            GUINT_TO_POINTER (handle)) != NULL);
+}
+
 static GHashTable *
 _get_contact_statuses (GObject *obj,
                        const GArray *contacts,
                        GError **error)
 {
     GHashTable *status_table = g_hash_table_new_full (g_direct_hash,
-        g_direct_equal, NULL, NULL);
+        g_direct_equal, NULL, haze_status_unref);
     HazeConnection *conn = HAZE_CONNECTION (obj);
     TpBaseConnection *base_conn = TP_BASE_CONNECTION (obj);
     TpHandleRepoIface *handle_repo =
@@ -183,6 +362,18 @@ _get_contact_statuses (GObject *obj,
 
         g_assert (tp_handle_is_valid (handle_repo, handle, NULL));
 
+        tp_status = status_array_peek (conn->presences, handle);
+
+        if (tp_status == NULL && presence_is_held (conn, handle))
+            tp_status = status_array_peek (conn->emitted_presences, handle);
+
+        if (tp_status != NULL)
+        {
+            g_hash_table_insert (status_table, GINT_TO_POINTER (handle),
+                haze_status_ref ((HazeStatus *) tp_status));
+            continue;
+        }
+
         if (handle == base_conn->self_handle)
         {
             p_status = purple_account_get_active_status (conn->account);
@@ -208,6 +399,12 @@ _get_contact_statuses (GObject *obj,
 
         tp_status = _get_tp_status (p_status);
         g_hash_table_insert (status_table, GINT_TO_POINTER (handle), tp_status);
+
+        /* Our own status changes aren't reported per buddy, and a held
+         * change will set the entry when it's released */
+        if (handle != base_conn->self_handle &&
+            !presence_is_held (conn, handle))
+            status_array_set (&conn->presences, handle, tp_status);
     }
 
     return status_table;
@@ -231,7 +428,278 @@ haze_connection_presence_account_status_changed (PurpleAccount *account,
 
         tp_presence_mixin_emit_one_presence_update (G_OBJECT (base_conn),
             base_conn->self_handle, tp_status);
+        haze_status_unref (tp_status);
+    }
+}
+
+/* After signing on, or when the server replays everyone's presence,
+ * libpurple reports each buddy's presence with a separate signal. Rather than
+ * emitting PresencesChanged for each one, updates are collected, the latest
+ * for each contact winning, and signalled together once the main loop is
+ * idle, or presence_delay_ms after the first of them at the latest, so that a
+ * busy main loop can't hold them back.
+ *
+ * HAZE_PRESENCE_DELAY overrides the delay; 0 signals each update at once.
+ */
+#define DEFAULT_PRESENCE_DELAY_MS 100
+
+static guint presence_delay_ms = DEFAULT_PRESENCE_DELAY_MS;
+
+static void
+flush_presences (HazeConnection *conn)
+{
+    GHashTable *pending = conn->pending_presences;
+    GHashTableIter iter;
+    gpointer k, v;
+
+    if (conn->presence_idle_id != 0)
+    {
+        g_source_remove (conn->presence_idle_id);
+        conn->presence_idle_id = 0;
+    }
+
+    if (conn->presence_timeout_id != 0)
+    {
+        g_source_remove (conn->presence_timeout_id);
+        conn->presence_timeout_id = 0;
+    }
+
+    if (pending == NULL)
+        return;
+
+    /* Start afresh, in case signalling re-enters us */
+    conn->pending_presences = NULL;
+
+    g_hash_table_iter_init (&iter, pending);
+
+    while (g_hash_table_iter_next (&iter, &k, &v))
+        status_array_set (&conn->emitted_presences, GPOINTER_TO_UINT (k), v);
+
+    /* Everything pending may have turned out to be a duplicate */
+    if (g_hash_table_size (pending) > 0)
+        tp_presence_mixin_emit_presence_update (G_OBJECT (conn), pending);
+
+    g_hash_table_unref (pending);
+}
+
+static gboolean
+flush_presences_cb (gpointer data)
+{
+    flush_presences (data);
+    return FALSE;
+}
+
+/* The running totals go to the debug log, so they can be watched through
+ * the Debug interface while the connection is up. */
+static void
+count_duplicate (HazeConnection *conn,
+                 TpHandle handle)
+{
+    conn->presence_duplicates++;
+    DEBUG ("dropped a duplicate presence update for handle %u; %u dropped "
+        "so far", handle, conn->presence_duplicates);
+}
+
+static gboolean
+statuses_equal (TpPresenceStatus *a,
+                TpPresenceStatus *b)
+{
+    return (a == b || (a != NULL && b != NULL && haze_status_equal (a, b)));
+}
+
+/* Takes ownership of @tp_status. */
+static void
+queue_presence (HazeConnection *conn,
+                TpHandle handle,
+                TpPresenceStatus *tp_status)
+{
+    TpPresenceStatus *pending = NULL;
+
+    /* This is what clients should see from now on, even if it turns out not
+     * to need signalling */
+    status_array_set (&conn->presences, handle, tp_status);
+
+    if (conn->pending_presences == NULL)
+    {
+        conn->pending_presences = g_hash_table_new_full (NULL, NULL, NULL,
+            haze_status_unref);
+    }
+    else
+    {
+        pending = g_hash_table_lookup (conn->pending_presences,
+            GUINT_TO_POINTER (handle));
+    }
+
+    /* libpurple often reports the same change more than once, for instance
+     * as both a status change and a sign-on. */
+    if (statuses_equal (tp_status,
+            status_array_peek (conn->emitted_presences, handle)))
+    {
+        count_duplicate (conn, handle);
+
+        /* Anything pending for this contact is now out of date */
+        if (pending != NULL)
+            g_hash_table_remove (conn->pending_presences,
+                GUINT_TO_POINTER (handle));
+
+        haze_status_unref (tp_status);
+        return;
+    }
+
+    if (statuses_equal (tp_status, pending))
+    {
+        count_duplicate (conn, handle);
+        haze_status_unref (tp_status);
+        return;
+    }
+
+    g_hash_table_insert (conn->pending_presences, GUINT_TO_POINTER (handle),
+        tp_status);
+
+    if (presence_delay_ms == 0)
+    {
+        flush_presences (conn);
+        return;
+    }
+
+    if (conn->presence_idle_id == 0)
+        conn->presence_idle_id = g_idle_add (flush_presences_cb, conn);
+
+    if (conn->presence_timeout_id == 0)
+        conn->presence_timeout_id = g_timeout_add (presence_delay_ms,
+            flush_presences_cb, conn);
+}
+
+/* Contacts with flaky connections may sign off and back on several times a
+ * second. So when a contact signs off, the change is held back until it has
+ * had presence_damping_ms without any further changes; if it has signed
+ * back on by then, and nothing else has changed, nothing is signalled at
+ * all. Signing on, and other changes, aren't held back unless a sign-off
+ * already is. While a change is held back, GetPresences and the contact
+ * attributes keep reporting the previous status, so that clients aren't
+ * left believing a change nobody signalled.
+ *
+ * Damping delays genuine sign-offs too, so it's off unless
+ * HAZE_PRESENCE_DAMPING sets a quiet period.
+ */
+#define DEFAULT_PRESENCE_DAMPING_MS 0
+
+static guint presence_damping_ms = DEFAULT_PRESENCE_DAMPING_MS;
+
+typedef struct {
+    TpPresenceStatus *status;
+    /* Monotonic time */
+    gint64 release_at;
+} HeldPresence;
+
+static void
+held_presence_free (gpointer p)
+{
+    HeldPresence *held = p;
+
+    haze_status_unref (held->status);
+    g_slice_free (HeldPresence, held);
+}
+
+static gboolean release_presences_cb (gpointer data);
+
+static void
+schedule_release (HazeConnection *conn,
+                  gint64 release_at,
+                  gint64 now)
+{
+    conn->presence_release_id = g_timeout_add (
+        (release_at - now + 999) / 1000, release_presences_cb, conn);
+}
+
+static gboolean
+release_presences_cb (gpointer data)
+{
+    HazeConnection *conn = data;
+    gint64 now = g_get_monotonic_time ();
+    gint64 next = G_MAXINT64;
+    GHashTableIter iter;
+    gpointer k, v;
+
+    conn->presence_release_id = 0;
+    g_hash_table_iter_init (&iter, conn->held_presences);
+
+    while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+        HeldPresence *held = v;
+
+        if (held->release_at > now)
+        {
+            next = MIN (next, held->release_at);
+            continue;
+        }
+
+        queue_presence (conn, GPOINTER_TO_UINT (k),
+            (TpPresenceStatus *) haze_status_ref ((HazeStatus *) held->status));
+        g_hash_table_iter_remove (&iter);
+    }
+
+    if (next != G_MAXINT64)
+        schedule_release (conn, next, now);
+
+    return FALSE;
+}
+
+/* Takes ownership of @tp_status. */
+static void
+damp_presence (HazeConnection *conn,
+               TpHandle handle,
+               TpPresenceStatus *tp_status)
+{
+    HeldPresence *held = NULL;
+    gint64 now;
+
+    if (conn->held_presences != NULL)
+        held = g_hash_table_lookup (conn->held_presences,
+            GUINT_TO_POINTER (handle));
+
+    if (held == NULL &&
+        (presence_damping_ms == 0 ||
+         tp_status->index != HAZE_STATUS_OFFLINE))
+    {
+        queue_presence (conn, handle, tp_status);
+        return;
     }
+
+    now = g_get_monotonic_time ();
+
+    if (held != NULL)
+    {
+        /* Wait for things to calm down */
+        if (statuses_equal (tp_status, held->status))
+        {
+            count_duplicate (conn, handle);
+        }
+        else
+        {
+            conn->presence_damped++;
+            DEBUG ("damped a presence change for handle %u; %u damped so far",
+                handle, conn->presence_damped);
+        }
+
+        haze_status_unref (held->status);
+        held->status = tp_status;
+        held->release_at = now + (gint64) presence_damping_ms * 1000;
+        return;
+    }
+
+    if (conn->held_presences == NULL)
+        conn->held_presences = g_hash_table_new_full (NULL, NULL, NULL,
+            held_presence_free);
+
+    held = g_slice_new0 (HeldPresence);
+    held->status = tp_status;
+    held->release_at = now + (gint64) presence_damping_ms * 1000;
+    g_hash_table_insert (conn->held_presences, GUINT_TO_POINTER (handle),
+        held);
+
+    if (conn->presence_release_id == 0)
+        schedule_release (conn, held->release_at, now);
 }
 
 static void
@@ -240,21 +708,45 @@ update_status (PurpleBuddy *buddy,
 {
     PurpleAccount *account = purple_buddy_get_account (buddy);
     HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (account);
-    TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
-    TpHandleRepoIface *handle_repo =
-        tp_base_connection_get_handles (base_conn, TP_HANDLE_TYPE_CONTACT);
 
     const gchar *bname = purple_buddy_get_name (buddy);
-    TpHandle handle = tp_handle_ensure (handle_repo, bname, NULL, NULL);
+    TpHandle handle = haze_connection_get_buddy_handle (conn, buddy);
 
     TpPresenceStatus *tp_status;
 
     DEBUG ("%s changed to status %s", bname, purple_status_get_id (status));
 
+    if (G_UNLIKELY (handle == 0))
+        return;
+
     tp_status = _get_tp_status (status);
+    damp_presence (conn, handle, tp_status);
+}
 
-    tp_presence_mixin_emit_one_presence_update (G_OBJECT (conn), handle,
-        tp_status);
+/* A contact whose buddies come and go may have a different status, or none
+ * at all, so look it up again next time. */
+static void
+buddy_added_removed_cb (PurpleBuddy *buddy,
+                        gpointer unused)
+{
+    PurpleAccount *account = purple_buddy_get_account (buddy);
+    HazeConnection *conn;
+    TpHandle handle;
+
+    if (account->ui_data == NULL)
+        return;
+
+    conn = ACCOUNT_GET_HAZE_CONNECTION (account);
+
+    /* Every buddy is removed when a disconnected connection deletes its
+     * account, by which time the table is gone */
+    if (TP_BASE_CONNECTION (conn)->status == TP_CONNECTION_STATUS_DISCONNECTED)
+        return;
+
+    handle = haze_connection_get_buddy_handle (conn, buddy);
+
+    if (handle != 0)
+        status_array_set (&conn->presences, handle, NULL);
 }
 
 static void
@@ -263,6 +755,9 @@ status_changed_cb (PurpleBuddy *buddy,
                    PurpleStatus *new_status,
                    gpointer unused)
 {
+    if (purple_buddy_get_account (buddy)->ui_data == NULL)
+        return;
+
     update_status (buddy, new_status);
 }
 
@@ -274,6 +769,10 @@ signed_on_off_cb (PurpleBuddy *buddy,
     gboolean signed_on = GPOINTER_TO_INT (data);
     */
     PurplePresence *presence = purple_buddy_get_presence (buddy);
+
+    if (purple_buddy_get_account (buddy)->ui_data == NULL)
+        return;
+
     update_status (buddy, purple_presence_get_active_status (presence));
 }
 
@@ -319,6 +818,14 @@ void
 haze_connection_presence_class_init (GObjectClass *object_class)
 {
     void *blist_handle = purple_blist_get_handle ();
+    const gchar *delay = g_getenv ("HAZE_PRESENCE_DELAY");
+    const gchar *damping = g_getenv ("HAZE_PRESENCE_DAMPING");
+
+    if (delay != NULL && *delay != '\0')
+        presence_delay_ms = strtoul (delay, NULL, 10);
+
+    if (damping != NULL && *damping != '\0')
+        presence_damping_ms = strtoul (damping, NULL, 10);
 
     purple_signal_connect (blist_handle, "buddy-status-changed", object_class,
         PURPLE_CALLBACK (status_changed_cb), NULL);
@@ -326,6 +833,10 @@ haze_connection_presence_class_init (GObjectClass *object_class)
         PURPLE_CALLBACK (signed_on_off_cb), GINT_TO_POINTER (TRUE));
     purple_signal_connect (blist_handle, "buddy-signed-off", object_class,
         PURPLE_CALLBACK (signed_on_off_cb), GINT_TO_POINTER (FALSE));
+    purple_signal_connect (blist_handle, "buddy-added", object_class,
+        PURPLE_CALLBACK (buddy_added_removed_cb), NULL);
+    purple_signal_connect (blist_handle, "buddy-removed", object_class,
+        PURPLE_CALLBACK (buddy_added_removed_cb), NULL);
 
     tp_presence_mixin_class_init (object_class,
         G_STRUCT_OFFSET (HazeConnectionClass, presence_class),
@@ -341,3 +852,30 @@ haze_connection_presence_init (GObject *object)
         presence));
     tp_presence_mixin_simple_presence_register_with_contacts_mixin (object);
 }
+
+void
+haze_connection_presence_finalize (GObject *object)
+{
+    HazeConnection *conn = HAZE_CONNECTION (object);
+
+    /* Nobody is listening any more */
+    if (conn->presence_idle_id != 0)
+        g_source_remove (conn->presence_idle_id);
+
+    if (conn->presence_timeout_id != 0)
+        g_source_remove (conn->presence_timeout_id);
+
+    if (conn->presence_release_id != 0)
+        g_source_remove (conn->presence_release_id);
+
+    if (conn->presence_duplicates > 0 || conn->presence_damped > 0)
+        DEBUG ("suppressed %u duplicate presence updates, and damped %u "
+            "flapping contacts' updates", conn->presence_duplicates,
+            conn->presence_damped);
+
+    tp_clear_pointer (&conn->pending_presences, g_hash_table_unref);
+    tp_clear_pointer (&conn->held_presences, g_hash_table_unref);
+    status_array_free (&conn->emitted_presences);
+
+    status_array_free (&conn->presences);
+}
@@ -43,6 +43,7 @@
 #include "connection-mail.h"
 #include "extensions/extensions.h"
 #include "request.h"
+#include "state.h"
 
 #include "connection-capabilities.h"
 
@@ -90,6 +91,9 @@ G_DEFINE_TYPE_WITH_CODE(HazeConnection,
         tp_base_contact_list_mixin_blocking_iface_init);
     G_IMPLEMENT_INTERFACE (HAZE_TYPE_SVC_CONNECTION_INTERFACE_MAIL_NOTIFICATION,
         haze_connection_mail_iface_init);
+    G_IMPLEMENT_INTERFACE (
+        HAZE_TYPE_SVC_CONNECTION_INTERFACE_CONTACT_LIST_CHANGES,
+        haze_contact_list_changes_iface_init);
     );
 
 static const gchar * implemented_interfaces[] = {
@@ -104,6 +108,7 @@ static const gchar * implemented_interfaces[] = {
 
     TP_IFACE_CONNECTION_INTERFACE_CONTACT_LIST,
     TP_IFACE_CONNECTION_INTERFACE_CONTACT_GROUPS,
+    HAZE_IFACE_CONNECTION_INTERFACE_CONTACT_LIST_CHANGES,
     TP_IFACE_CONNECTION_INTERFACE_REQUESTS,
     TP_IFACE_CONNECTION_INTERFACE_PRESENCE,
     TP_IFACE_CONNECTION_INTERFACE_SIMPLE_PRESENCE,
@@ -150,6 +155,12 @@ struct _HazeConnectionPrivate
     /* Set to TRUE when purple_account_connect has been called. */
     gboolean connect_called;
 
+    /* Set if the account, with its buddy list, was left over from an earlier
+     * connection or loaded from the persistent state directory. */
+    gboolean warm_start;
+    /* Monotonic time at which we started connecting, in microseconds */
+    gint64 connect_started;
+
     gboolean dispose_has_run;
 };
 
@@ -179,8 +190,12 @@ connected_cb (PurpleConnection *pc)
         tp_base_connection_add_interfaces (base_conn, blocking_ifaces);
     }
 
-    tp_base_contact_list_set_list_received (
-        (TpBaseContactList *) conn->contact_list);
+    haze_contact_list_set_list_received (conn->contact_list);
+
+    DEBUG ("%s connected from %s state in %" G_GINT64_FORMAT " ms",
+        purple_account_get_username (conn->account),
+        conn->priv->warm_start ? "warm" : "cold",
+        (g_get_monotonic_time () - conn->priv->connect_started) / 1000);
 
     tp_base_connection_change_status (base_conn,
         TP_CONNECTION_STATUS_CONNECTED,
@@ -393,6 +408,9 @@ set_option (
  * called immediately after constructing a connection. It's a shame GObject
  * constructors can't fail.
  *
+ * If a persistent state directory is in use, an account which is not in use
+ * by another connection is reused, together with its cached buddy list.
+ *
  * Returns: %TRUE if the account was successfully created and hooked up;
  *          %FALSE with @error set in the TP_ERROR domain if the account
  *          already existed or another error occurred.
@@ -404,11 +422,15 @@ haze_connection_create_account (HazeConnection *self,
     HazeConnectionPrivate *priv = self->priv;
     GHashTable *params = priv->parameters;
     PurplePluginProtocolInfo *prpl_info = priv->prpl_info;
+    PurpleAccount *account;
     GList *l;
 
     g_return_val_if_fail (self->account == NULL, FALSE);
 
-    if (purple_accounts_find (priv->username, priv->prpl_id) != NULL)
+    account = purple_accounts_find (priv->username, priv->prpl_id);
+
+    if (account != NULL &&
+        (account->ui_data != NULL || !haze_state_dir_is_persistent ()))
       {
         g_set_error (error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
             "a connection already exists to %s on %s", priv->username,
@@ -416,8 +438,29 @@ haze_connection_create_account (HazeConnection *self,
         return FALSE;
       }
 
-    self->account = purple_account_new (priv->username, priv->prpl_id);
-    purple_accounts_add (self->account);
+    if (account != NULL)
+      {
+        DEBUG ("reusing cached account %s", priv->username);
+
+        /* Start from a clean slate, so that parameters which were not passed
+         * this time get their defaults rather than last time's values, and
+         * the user is asked for a password if none was passed.
+         */
+        g_hash_table_remove_all (account->settings);
+        purple_account_set_password (account, NULL);
+
+        self->account = account;
+        priv->warm_start = TRUE;
+      }
+    else
+      {
+        self->account = purple_account_new (priv->username, priv->prpl_id);
+        purple_accounts_add (self->account);
+      }
+
+    /* Passwords belong to the account manager, not to accounts.xml. */
+    if (haze_state_dir_is_persistent ())
+      purple_account_set_remember_password (self->account, FALSE);
 
     if (priv->password != NULL)
       purple_account_set_password (self->account, priv->password);
@@ -501,6 +544,8 @@ _haze_connection_start_connecting (TpBaseConnection *base,
 
     g_return_val_if_fail (self->account != NULL, FALSE);
 
+    priv->connect_started = g_get_monotonic_time ();
+
     base->self_handle = tp_handle_ensure (contact_handles,
         purple_account_get_username (self->account), NULL, error);
     if (!base->self_handle)
@@ -762,15 +807,37 @@ haze_connection_finalize (GObject *object)
     HazeConnectionPrivate *priv = self->priv;
 
     tp_contacts_mixin_finalize (object);
+    haze_connection_presence_finalize (object);
     tp_presence_mixin_finalize (object);
 
     haze_connection_capabilities_finalize (object);
+    haze_connection_avatars_finalize (object);
 
     g_strfreev (self->acceptable_avatar_mime_types);
     g_free (priv->username);
     g_free (priv->password);
 
     if (self->account != NULL)
+      {
+        GSList *buddies, *l;
+
+        /* Our handles will mean nothing to the next connection */
+        buddies = purple_find_buddies (self->account, NULL);
+
+        for (l = buddies; l != NULL; l = l->next)
+          haze_connection_forget_buddy_handle (l->data);
+
+        g_slist_free (buddies);
+      }
+
+    if (self->account != NULL && haze_state_dir_is_persistent ())
+      {
+        /* Keep the account and its buddy list for the next connection. */
+        DEBUG ("detaching account %s", self->account->username);
+        self->account->ui_data = NULL;
+        purple_account_set_enabled (self->account, UI_ID, FALSE);
+      }
+    else if (self->account != NULL)
       {
         DEBUG ("deleting account %s", self->account->username);
         purple_accounts_delete (self->account);
@@ -779,6 +846,34 @@ haze_connection_finalize (GObject *object)
     G_OBJECT_CLASS (haze_connection_parent_class)->finalize (object);
 }
 
+/* What haze_connection_get_buddy_handle() keeps in a buddy's ui_data. */
+typedef struct {
+    TpHandle handle;
+    /* The name the handle was looked up from. Prpls which normalize names
+     * rename buddies with purple_blist_rename_buddy(), which emits no
+     * signal, so this is how renames are noticed. */
+    gchar *name;
+} HazeBuddyHandle;
+
+/* Runs after every other buddy-removed handler, so that they can all still
+ * look up the buddy's handle. */
+static void
+buddy_removed_cb (PurpleBuddy *buddy,
+                  gpointer unused)
+{
+    HazeBuddyHandle *bh = ((PurpleBlistNode *) buddy)->ui_data;
+
+    /* Only buddies of connected accounts have handles */
+    if (bh == NULL)
+        return;
+
+    if (bh->handle != 0)
+        haze_connection_avatars_forget_contact (buddy->account->ui_data,
+            bh->handle);
+
+    haze_connection_forget_buddy_handle (buddy);
+}
+
 static void
 haze_connection_class_init (HazeConnectionClass *klass)
 {
@@ -863,6 +958,10 @@ haze_connection_class_init (HazeConnectionClass *klass)
     haze_connection_aliasing_class_init (object_class);
     haze_connection_avatars_class_init (object_class);
     haze_connection_capabilities_class_init (object_class);
+
+    purple_signal_connect_priority (purple_blist_get_handle (),
+        "buddy-removed", object_class, PURPLE_CALLBACK (buddy_removed_cb),
+        NULL, PURPLE_SIGNAL_PRIORITY_HIGHEST);
 }
 
 static void
@@ -929,6 +1028,73 @@ haze_connection_handle_inspect (HazeConnection *conn,
     return tp_handle_inspect (handle_repo, handle);
 }
 
+/**
+ * haze_connection_get_buddy_handle:
+ * @conn: a connection
+ * @buddy: one of @conn's account's buddies
+ *
+ * Returns @buddy's contact handle. Buddy list signals arrive in their
+ * thousands when a roster is loaded or presences change en masse, so the
+ * handle is looked up (normalizing the buddy's name) only once, and then
+ * kept in the buddy's ui_data, together with the name it was looked up from,
+ * until the buddy is removed, renamed, or @conn goes away. Handles are never
+ * freed while @conn exists, so no reference needs to be held.
+ *
+ * Returns: @buddy's handle, or 0 if its name is not a valid identifier
+ */
+TpHandle
+haze_connection_get_buddy_handle (HazeConnection *conn,
+                                  PurpleBuddy *buddy)
+{
+    PurpleBlistNode *node = (PurpleBlistNode *) buddy;
+    HazeBuddyHandle *bh = node->ui_data;
+    const gchar *name = purple_buddy_get_name (buddy);
+    TpHandleRepoIface *contact_repo;
+    TpHandle old_handle = 0;
+    gboolean renamed = FALSE;
+
+    if (G_LIKELY (bh != NULL && !tp_strdiff (bh->name, name)))
+        return bh->handle;
+
+    if (bh == NULL)
+    {
+        bh = g_slice_new0 (HazeBuddyHandle);
+        node->ui_data = bh;
+    }
+    else
+    {
+        old_handle = bh->handle;
+        renamed = TRUE;
+        g_free (bh->name);
+    }
+
+    contact_repo = tp_base_connection_get_handles (TP_BASE_CONNECTION (conn),
+        TP_HANDLE_TYPE_CONTACT);
+    bh->handle = tp_handle_ensure (contact_repo, name, NULL, NULL);
+    bh->name = g_strdup (name);
+
+    if (renamed && old_handle != bh->handle && conn->contact_list != NULL)
+        haze_contact_list_buddy_renamed (conn->contact_list, buddy,
+            old_handle, bh->handle);
+
+    return bh->handle;
+}
+
+/* Forgets the handle cached by haze_connection_get_buddy_handle(). */
+void
+haze_connection_forget_buddy_handle (PurpleBuddy *buddy)
+{
+    PurpleBlistNode *node = (PurpleBlistNode *) buddy;
+    HazeBuddyHandle *bh = node->ui_data;
+
+    if (bh == NULL)
+        return;
+
+    g_free (bh->name);
+    g_slice_free (HazeBuddyHandle, bh);
+    node->ui_data = NULL;
+}
+
 /**
  * Get the group that "most" libpurple prpls will use for ungrouped contacts.
  */
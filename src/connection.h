@@ -60,7 +60,28 @@ struct _HazeConnection {
     TpContactsMixin contacts;
     TpPresenceMixin presence;
 
+    /* Each contact's current status, indexed by handle, not counting
+     * changes which are being held back; see connection-presence.c */
+    GPtrArray *presences;
+
+    /* Contacts' presences which haven't been signalled yet; see
+     * connection-presence.c */
+    GHashTable *pending_presences;
+    guint presence_idle_id;
+    guint presence_timeout_id;
+    /* The last status signalled for each contact, indexed by handle */
+    GPtrArray *emitted_presences;
+    /* Maps handles to HeldPresence; see damp_presence() */
+    GHashTable *held_presences;
+    guint presence_release_id;
+    /* Updates which weren't signalled because they changed nothing, or were
+     * superseded while a flapping contact was being damped */
+    guint presence_duplicates;
+    guint presence_damped;
+
     gchar **acceptable_avatar_mime_types;
+    /* Maps handles to AvatarToken; see connection-avatars.c */
+    GHashTable *avatar_tokens;
 
     GHashTable *client_caps;
 
@@ -87,6 +108,10 @@ haze_connection_handle_inspect (HazeConnection *conn,
 
 gboolean haze_connection_create_account (HazeConnection *self, GError **error);
 
+TpHandle haze_connection_get_buddy_handle (HazeConnection *conn,
+                                           PurpleBuddy *buddy);
+void haze_connection_forget_buddy_handle (PurpleBuddy *buddy);
+
 GType haze_connection_get_type (void);
 
 /* TYPE MACROS */
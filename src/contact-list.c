@@ -29,6 +29,8 @@
 #include "connection.h"
 #include "contact-list.h"
 #include "debug.h"
+#include "extensions/extensions.h"
+#include "state.h"
 
 typedef struct _PublishRequestData PublishRequestData;
 
@@ -72,10 +74,74 @@ struct _HazeContactListPrivate {
     /* Contacts whose publish requests we've accepted or declined. */
     TpHandleSet *publishing_to;
     TpHandleSet *not_publishing_to;
+    /* Whether the above have been merged with the state directory's publish
+     * store; see publish_store_load(). */
+    gboolean publish_store_loaded;
+
+    /* Changes to the contact list which haven't been signalled yet; see
+     * queue_prepare(). Group names (owned) map to TpHandleSets of the
+     * contacts added to or removed from that group. */
+    TpHandleSet *pending_changed;
+    TpHandleSet *pending_removed;
+    TpHandleSet *pending_blocking;
+    GHashTable *pending_groups_added;
+    GHashTable *pending_groups_removed;
+    guint n_pending;
+    /* Monotonic time of the oldest pending change */
+    gint64 pending_since;
+    guint flush_id;
+    /* Nesting depth of batch_begin() */
+    guint batch_depth;
+
+    /* Maps TpHandle to a GSList of this account's PurpleBuddy instances with
+     * that name, one per group; see ensure_buddy_index(). */
+    GHashTable *buddies;
+    /* Maps each of those PurpleBuddy instances to the PurpleGroup it was in
+     * when last seen, so that moves between groups can be noticed. */
+    GHashTable *buddy_groups;
+    /* Maps the names (owned) of the groups this account's buddies are in, or
+     * which this connection created, to TpHandleSets of their members. */
+    GHashTable *groups;
+    /* The names (owned) of groups which have been dropped from the index
+     * since the last flush because their last member left them; see
+     * group_index_remove(). */
+    GHashTable *emptied_groups;
+
+    /* Contacts on the account's deny list; see ensure_blocked(). */
+    TpHandleSet *blocked;
+
+    /* The contact list's version, or 0 if it hasn't been received yet, and
+     * the contacts which changed in versions after log_floor; see
+     * change_log_append(). */
+    guint64 version;
+    guint64 log_floor;
+    GArray *change_log;
+
+    /* Maps the handles of contacts which were on the list last time the
+     * account was connected, but haven't been seen on it yet this time, to
+     * GStrvs of the groups they were in; see roster_restore(). */
+    GHashTable *provisional;
+    guint settle_id;
+    /* Monotonic times */
+    gint64 settle_deadline;
+    gint64 last_buddy_added;
 
     gboolean dispose_has_run;
 };
 
+typedef struct {
+    guint64 version;
+    TpHandle handle;
+} ChangeLogEntry;
+
+static void queue_init (HazeContactList *self);
+static void roster_save (HazeContactList *self);
+static void roster_restore (HazeContactList *self);
+static gboolean roster_forget (HazeContactList *self, TpHandle handle);
+static void account_removed_cb (PurpleAccount *account, gpointer unused);
+static void publish_store_load (HazeContactList *self);
+static void publish_store_sync (HazeContactList *self);
+
 static void haze_contact_list_mutable_init (TpMutableContactListInterface *);
 static void haze_contact_list_groups_init (TpContactGroupListInterface *);
 static void haze_contact_list_mutable_groups_init (
@@ -103,6 +169,8 @@ haze_contact_list_init (HazeContactList *self)
 
     self->priv = priv;
 
+    priv->change_log = g_array_new (FALSE, FALSE, sizeof (ChangeLogEntry));
+
     priv->dispose_has_run = FALSE;
 }
 
@@ -133,9 +201,28 @@ haze_contact_list_constructor (GType type, guint n_props,
     self->priv->pending_publish_requests = g_hash_table_new_full (NULL, NULL,
         NULL, (GDestroyNotify) publish_request_data_free);
 
+    queue_init (self);
+
+    self->priv->groups = g_hash_table_new_full (g_str_hash, g_str_equal,
+        g_free, (GDestroyNotify) tp_handle_set_destroy);
+    self->priv->emptied_groups = g_hash_table_new_full (g_str_hash,
+        g_str_equal, g_free, NULL);
+    self->priv->provisional = g_hash_table_new_full (NULL, NULL, NULL,
+        (GDestroyNotify) g_strfreev);
+
     return obj;
 }
 
+static gboolean
+is_stored_request (gpointer key,
+    gpointer value,
+    gpointer user_data)
+{
+  PublishRequestData *prd = value;
+
+  return (prd->allow == NULL);
+}
+
 static void
 haze_contact_list_dispose (GObject *object)
 {
@@ -147,11 +234,39 @@ haze_contact_list_dispose (GObject *object)
 
     priv->dispose_has_run = TRUE;
 
+    if (priv->flush_id != 0)
+    {
+        g_source_remove (priv->flush_id);
+        priv->flush_id = 0;
+    }
+
+    if (priv->settle_id != 0)
+    {
+        g_source_remove (priv->settle_id);
+        priv->settle_id = 0;
+    }
+
+    roster_save (self);
+    tp_clear_pointer (&priv->provisional, g_hash_table_unref);
+
     tp_clear_pointer (&priv->publishing_to, tp_handle_set_destroy);
     tp_clear_pointer (&priv->not_publishing_to, tp_handle_set_destroy);
+    tp_clear_pointer (&priv->pending_changed, tp_handle_set_destroy);
+    tp_clear_pointer (&priv->pending_removed, tp_handle_set_destroy);
+    tp_clear_pointer (&priv->pending_blocking, tp_handle_set_destroy);
+    tp_clear_pointer (&priv->pending_groups_added, g_hash_table_unref);
+    tp_clear_pointer (&priv->pending_groups_removed, g_hash_table_unref);
+    tp_clear_pointer (&priv->buddies, g_hash_table_unref);
+    tp_clear_pointer (&priv->buddy_groups, g_hash_table_unref);
+    tp_clear_pointer (&priv->groups, g_hash_table_unref);
+    tp_clear_pointer (&priv->emptied_groups, g_hash_table_unref);
+    tp_clear_pointer (&priv->blocked, tp_handle_set_destroy);
 
     if (priv->pending_publish_requests)
     {
+        /* Requests from the publish store aren't libpurple's to close */
+        g_hash_table_foreach_remove (priv->pending_publish_requests,
+            is_stored_request, NULL);
         g_assert (g_hash_table_size (priv->pending_publish_requests) == 0);
         g_hash_table_destroy (priv->pending_publish_requests);
         priv->pending_publish_requests = NULL;
@@ -164,199 +279,1296 @@ haze_contact_list_dispose (GObject *object)
 static void
 haze_contact_list_finalize (GObject *object)
 {
+    HazeContactList *self = HAZE_CONTACT_LIST (object);
+
+    g_array_free (self->priv->change_log, TRUE);
+
     G_OBJECT_CLASS (haze_contact_list_parent_class)->finalize (object);
 }
 
 static void buddy_added_cb (PurpleBuddy *buddy, gpointer unused);
 static void buddy_removed_cb (PurpleBuddy *buddy, gpointer unused);
 
-static TpHandleSet *
-haze_contact_list_dup_contacts (TpBaseContactList *cl)
+/* Loading a large roster makes libpurple emit buddy-added for every buddy,
+ * one at a time. Rather than signalling each change on its own, changes are
+ * queued and signalled together once the main loop is idle, or once there
+ * are MAX_PENDING_CHANGES of them or the oldest is MAX_PENDING_USEC old, so
+ * that a busy main loop can't hold them back for ever.
+ *
+ * Contacts which are added and removed are signalled as added, then as
+ * regrouped, then as removed, and then changes to who is blocked are
+ * signalled; if a change would be signalled in the wrong
+ * order relative to one which is already queued, the queue is flushed first.
+ *
+ * Between batch_begin() and batch_end(), the size and age limits don't apply,
+ * so that a bulk edit requested over D-Bus is signalled as one change when
+ * it's finished.
+ */
+#define MAX_PENDING_CHANGES 1000
+#define MAX_PENDING_USEC (250 * 1000)
+
+static void
+queue_init (HazeContactList *self)
 {
-  HazeContactList *self = HAZE_CONTACT_LIST (cl);
-  TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
-  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base_conn,
-      TP_HANDLE_TYPE_CONTACT);
-  /* The list initially contains anyone we're definitely publishing to.
-   * Because libpurple, that's only people whose request we accepted during
-   * this session :-( */
-  TpHandleSet *handles = tp_handle_set_copy (self->priv->publishing_to);
-  GSList *buddies = purple_find_buddies (self->priv->conn->account, NULL);
-  GSList *sl_iter;
-  GHashTableIter hash_iter;
+  HazeContactListPrivate *priv = self->priv;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
+
+  priv->pending_changed = tp_handle_set_new (contact_repo);
+  priv->pending_removed = tp_handle_set_new (contact_repo);
+  priv->pending_blocking = tp_handle_set_new (contact_repo);
+  priv->pending_groups_added = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, (GDestroyNotify) tp_handle_set_destroy);
+  priv->pending_groups_removed = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, (GDestroyNotify) tp_handle_set_destroy);
+  priv->n_pending = 0;
+}
+
+/* Once their last members' departures have been signalled, announces that
+ * groups dropped from the index are gone, unless they have been recreated
+ * since. */
+static void
+emit_emptied_groups (HazeContactList *self)
+{
+  HazeContactListPrivate *priv = self->priv;
+  GPtrArray *gone;
+  GHashTableIter iter;
   gpointer k;
 
-  /* Also include anyone on our buddy list */
-  for (sl_iter = buddies; sl_iter != NULL; sl_iter = sl_iter->next)
-    {
-      TpHandle handle = tp_handle_ensure (contact_repo,
-          purple_buddy_get_name (sl_iter->data), NULL, NULL);
+  if (g_hash_table_size (priv->emptied_groups) == 0)
+    return;
+
+  gone = g_ptr_array_new_with_free_func (g_free);
+  g_hash_table_iter_init (&iter, priv->emptied_groups);
+
+  while (g_hash_table_iter_next (&iter, &k, NULL))
+    {
+      if (g_hash_table_lookup (priv->groups, k) == NULL)
+        g_ptr_array_add (gone, g_strdup (k));
+    }
+
+  g_hash_table_remove_all (priv->emptied_groups);
+
+  if (gone->len > 0)
+    tp_base_contact_list_groups_removed ((TpBaseContactList *) self,
+        (const gchar * const *) gone->pdata, gone->len);
+
+  g_ptr_array_unref (gone);
+}
+
+static void
+emit_pending_groups (HazeContactList *self,
+    GHashTable *groups,
+    gboolean added)
+{
+  GHashTableIter iter;
+  gpointer k, v;
+
+  g_hash_table_iter_init (&iter, groups);
+
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      const gchar *group_name = k;
+
+      if (added)
+        tp_base_contact_list_groups_changed ((TpBaseContactList *) self, v,
+            &group_name, 1, NULL, 0);
+      else
+        tp_base_contact_list_groups_changed ((TpBaseContactList *) self, v,
+            NULL, 0, &group_name, 1);
+    }
+}
+
+/* Each flush which changes who is on the list, or their subscription
+ * states, is a new version of the list. The contacts it changed are logged
+ * against that version, so that a client which has seen an earlier version
+ * can fetch just the contacts which have changed since; see
+ * haze_contact_list_get_contact_list_changes().
+ *
+ * Once the log has MAX_CHANGE_LOG entries, the older half is forgotten, and
+ * clients which have only seen versions that old are sent the whole list.
+ */
+#define MAX_CHANGE_LOG 4096
+
+static void
+change_log_append (HazeContactList *self,
+    TpHandleSet *set)
+{
+  HazeContactListPrivate *priv = self->priv;
+  TpIntsetFastIter iter;
+  TpHandle handle;
+
+  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (set));
+
+  while (tp_intset_fast_iter_next (&iter, &handle))
+    {
+      ChangeLogEntry entry = { priv->version, handle };
+
+      g_array_append_val (priv->change_log, entry);
+    }
+}
+
+static void
+change_log_trim (HazeContactList *self)
+{
+  HazeContactListPrivate *priv = self->priv;
+  GArray *log = priv->change_log;
+  guint i;
+
+  if (log->len <= MAX_CHANGE_LOG)
+    return;
+
+  /* Only forget whole versions */
+  for (i = log->len / 2;
+       i < log->len &&
+       g_array_index (log, ChangeLogEntry, i).version ==
+         g_array_index (log, ChangeLogEntry, i - 1).version;
+       i++)
+    ;
+
+  priv->log_floor = g_array_index (log, ChangeLogEntry, i - 1).version;
+  g_array_remove_range (log, 0, i);
+}
+
+static void
+haze_contact_list_flush (HazeContactList *self)
+{
+  HazeContactListPrivate *priv = self->priv;
+  TpHandleSet *changed, *removed, *blocking;
+  GHashTable *groups_added, *groups_removed;
+
+  if (priv->flush_id != 0)
+    {
+      g_source_remove (priv->flush_id);
+      priv->flush_id = 0;
+    }
+
+  if (priv->n_pending == 0)
+    return;
+
+  /* Signalling the changes may well re-enter us, so start a new queue
+   * first. */
+  changed = priv->pending_changed;
+  removed = priv->pending_removed;
+  blocking = priv->pending_blocking;
+  groups_added = priv->pending_groups_added;
+  groups_removed = priv->pending_groups_removed;
+  queue_init (self);
+
+  if (priv->version > 0 &&
+      (!tp_handle_set_is_empty (changed) || !tp_handle_set_is_empty (removed)))
+    {
+      priv->version++;
+      change_log_append (self, changed);
+      change_log_append (self, removed);
+      change_log_trim (self);
+    }
+
+  if (!tp_handle_set_is_empty (changed))
+    tp_base_contact_list_contacts_changed ((TpBaseContactList *) self,
+        changed, NULL);
+
+  emit_pending_groups (self, groups_added, TRUE);
+  emit_pending_groups (self, groups_removed, FALSE);
+  emit_emptied_groups (self);
+
+  if (!tp_handle_set_is_empty (removed))
+    tp_base_contact_list_contacts_changed ((TpBaseContactList *) self,
+        NULL, removed);
+
+  if (!tp_handle_set_is_empty (blocking))
+    tp_base_contact_list_contact_blocking_changed (
+        (TpBaseContactList *) self, blocking);
+
+  tp_handle_set_destroy (changed);
+  tp_handle_set_destroy (removed);
+  tp_handle_set_destroy (blocking);
+  g_hash_table_unref (groups_added);
+  g_hash_table_unref (groups_removed);
+}
+
+static gboolean
+flush_idle_cb (gpointer data)
+{
+  HazeContactList *self = data;
+
+  self->priv->flush_id = 0;
+  haze_contact_list_flush (self);
+  return FALSE;
+}
+
+/* Called before queueing a change; flushes the queue if it is too big or too
+ * old, and otherwise makes sure it will be flushed when the main loop is
+ * idle. */
+static void
+queue_prepare (HazeContactList *self)
+{
+  HazeContactListPrivate *priv = self->priv;
+  gint64 now = g_get_monotonic_time ();
+
+  if (priv->batch_depth == 0 &&
+      (priv->n_pending >= MAX_PENDING_CHANGES ||
+       (priv->n_pending > 0 &&
+        now - priv->pending_since >= MAX_PENDING_USEC)))
+    haze_contact_list_flush (self);
+
+  if (priv->n_pending == 0)
+    priv->pending_since = now;
+
+  priv->n_pending++;
+
+  if (priv->flush_id == 0)
+    priv->flush_id = g_idle_add (flush_idle_cb, self);
+}
+
+static gboolean
+pending_group_has (GHashTable *groups,
+    const gchar *group_name,
+    TpHandle handle)
+{
+  TpHandleSet *set = g_hash_table_lookup (groups, group_name);
+
+  return (set != NULL && tp_handle_set_is_member (set, handle));
+}
+
+static void
+pending_group_add (HazeContactList *self,
+    GHashTable *groups,
+    const gchar *group_name,
+    TpHandle handle)
+{
+  TpHandleSet *set = g_hash_table_lookup (groups, group_name);
+
+  if (set == NULL)
+    {
+      TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+          (TpBaseConnection *) self->priv->conn, TP_HANDLE_TYPE_CONTACT);
+
+      set = tp_handle_set_new (contact_repo);
+      g_hash_table_insert (groups, g_strdup (group_name), set);
+    }
+
+  tp_handle_set_add (set, handle);
+}
+
+static void
+queue_contact_changed (HazeContactList *self,
+    TpHandle handle)
+{
+  if (self->priv->dispose_has_run)
+    return;
+
+  if (tp_handle_set_is_member (self->priv->pending_removed, handle))
+    haze_contact_list_flush (self);
+
+  queue_prepare (self);
+  tp_handle_set_add (self->priv->pending_changed, handle);
+}
+
+static void
+queue_contact_removed (HazeContactList *self,
+    TpHandle handle)
+{
+  if (self->priv->dispose_has_run)
+    return;
+
+  if (tp_handle_set_is_member (self->priv->pending_changed, handle))
+    haze_contact_list_flush (self);
+
+  queue_prepare (self);
+  tp_handle_set_add (self->priv->pending_removed, handle);
+}
+
+static void
+queue_group_added (HazeContactList *self,
+    TpHandle handle,
+    const gchar *group_name)
+{
+  if (self->priv->dispose_has_run)
+    return;
+
+  if (pending_group_has (self->priv->pending_groups_removed, group_name,
+        handle) ||
+      tp_handle_set_is_member (self->priv->pending_removed, handle))
+    haze_contact_list_flush (self);
+
+  queue_prepare (self);
+  pending_group_add (self, self->priv->pending_groups_added, group_name,
+      handle);
+}
+
+static void
+queue_group_removed (HazeContactList *self,
+    TpHandle handle,
+    const gchar *group_name)
+{
+  if (self->priv->dispose_has_run)
+    return;
+
+  if (pending_group_has (self->priv->pending_groups_added, group_name,
+        handle))
+    haze_contact_list_flush (self);
+
+  queue_prepare (self);
+  pending_group_add (self, self->priv->pending_groups_removed, group_name,
+      handle);
+}
+
+static void
+queue_blocking_changed (HazeContactList *self,
+    TpHandle handle)
+{
+  if (self->priv->dispose_has_run)
+    return;
+
+  queue_prepare (self);
+  tp_handle_set_add (self->priv->pending_blocking, handle);
+}
+
+static void
+batch_begin (HazeContactList *self)
+{
+  self->priv->batch_depth++;
+}
+
+static void
+batch_end (HazeContactList *self)
+{
+  g_return_if_fail (self->priv->batch_depth > 0);
+
+  if (--self->priv->batch_depth == 0 && !self->priv->dispose_has_run)
+    haze_contact_list_flush (self);
+}
+
+/**
+ * haze_contact_list_set_list_received:
+ *
+ * Announces that the initial contact list has been received. Changes queued
+ * before this point are already reflected in the initial list, so they are
+ * dropped rather than signalled again.
+ */
+void
+haze_contact_list_set_list_received (HazeContactList *self)
+{
+  HazeContactListPrivate *priv = self->priv;
+
+  if (priv->flush_id != 0)
+    {
+      g_source_remove (priv->flush_id);
+      priv->flush_id = 0;
+    }
+
+  tp_handle_set_destroy (priv->pending_changed);
+  tp_handle_set_destroy (priv->pending_removed);
+  tp_handle_set_destroy (priv->pending_blocking);
+  g_hash_table_unref (priv->pending_groups_added);
+  g_hash_table_unref (priv->pending_groups_removed);
+  queue_init (self);
+
+  /* Clients may remember a version of the list from an earlier connection
+   * to the same account, so start from the current time, rather than 1, to
+   * make sure that they're sent the whole list. */
+  priv->version = MAX (priv->version + 1, (guint64) g_get_real_time ());
+  priv->log_floor = priv->version;
+  g_array_set_size (priv->change_log, 0);
+
+  roster_restore (self);
+  publish_store_load (self);
+
+  tp_base_contact_list_set_list_received ((TpBaseContactList *) self);
+}
+
+/* libpurple can only look buddies up by name, and purple_find_buddies() with
+ * no name walks the whole buddy list, including every other account's
+ * buddies; similarly, finding a group's members means walking every buddy in
+ * it. So each connection keeps its own index from handles to buddies, and
+ * from group names to members.
+ *
+ * The account's buddy list may have been loaded before the connection
+ * existed, so the index is built from it the first time it's needed, and
+ * kept up to date by buddy_added_cb() and buddy_removed_cb() after that.
+ */
+static void index_insert (HazeContactList *self, TpHandle handle,
+    PurpleBuddy *buddy);
+
+static GHashTable *
+ensure_buddy_index (HazeContactList *self)
+{
+  HazeContactListPrivate *priv = self->priv;
+  GSList *buddies, *l;
+
+  if (priv->buddies != NULL)
+    return priv->buddies;
+
+  priv->buddies = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) g_slist_free);
+  priv->buddy_groups = g_hash_table_new (NULL, NULL);
+
+  buddies = purple_find_buddies (priv->conn->account, NULL);
+
+  for (l = buddies; l != NULL; l = l->next)
+    {
+      TpHandle handle = haze_connection_get_buddy_handle (priv->conn,
+          l->data);
+
+      /* Noticing that a buddy has been renamed will have indexed it
+       * already */
+      if (G_LIKELY (handle != 0) &&
+          g_hash_table_lookup (priv->buddy_groups, l->data) == NULL)
+        index_insert (self, handle, l->data);
+    }
+
+  g_slist_free (buddies);
+  return priv->buddies;
+}
+
+/* Returns a borrowed list of the buddies for @handle, which is only valid
+ * until the next change to the buddy list. */
+static GSList *
+peek_buddies (HazeContactList *self,
+    TpHandle handle)
+{
+  return g_hash_table_lookup (ensure_buddy_index (self),
+      GUINT_TO_POINTER (handle));
+}
+
+/* Returns the members of @group_name, creating it in the index if
+ * necessary. */
+static TpHandleSet *
+group_index_ensure (HazeContactList *self,
+    const gchar *group_name)
+{
+  TpHandleSet *members = g_hash_table_lookup (self->priv->groups,
+      group_name);
+
+  if (members == NULL)
+    {
+      TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+          (TpBaseConnection *) self->priv->conn, TP_HANDLE_TYPE_CONTACT);
+
+      members = tp_handle_set_new (contact_repo);
+      g_hash_table_insert (self->priv->groups, g_strdup (group_name),
+          members);
+    }
+
+  return members;
+}
+
+/* Removes @handle from @group, unless another of its buddies is still in
+ * that group; this is possible in libpurple. If that leaves @group empty, it
+ * is dropped, and announced as removed at the next flush. */
+static void
+group_index_remove (HazeContactList *self,
+    PurpleGroup *group,
+    TpHandle handle)
+{
+  const gchar *group_name = purple_group_get_name (group);
+  TpHandleSet *members = g_hash_table_lookup (self->priv->groups,
+      group_name);
+  GSList *l;
+
+  if (members == NULL)
+    return;
+
+  for (l = g_hash_table_lookup (self->priv->buddies,
+        GUINT_TO_POINTER (handle));
+      l != NULL;
+      l = l->next)
+    {
+      if (purple_buddy_get_group (l->data) == group)
+        return;
+    }
+
+  tp_handle_set_remove (members, handle);
+
+  if (tp_handle_set_is_empty (members))
+    {
+      g_hash_table_insert (self->priv->emptied_groups, g_strdup (group_name),
+          NULL);
+      g_hash_table_remove (self->priv->groups, group_name);
+    }
+}
+
+static void
+index_insert (HazeContactList *self,
+    TpHandle handle,
+    PurpleBuddy *buddy)
+{
+  HazeContactListPrivate *priv = self->priv;
+  gpointer key = GUINT_TO_POINTER (handle);
+  GSList *buddies = g_hash_table_lookup (priv->buddies, key);
+  PurpleGroup *group = purple_buddy_get_group (buddy);
+
+  g_hash_table_steal (priv->buddies, key);
+  g_hash_table_insert (priv->buddies, key, g_slist_prepend (buddies, buddy));
+
+  g_hash_table_insert (priv->buddy_groups, buddy, group);
+  tp_handle_set_add (group_index_ensure (self, purple_group_get_name (group)),
+      handle);
+}
+
+/* Adds @buddy to the index. If it was already there, because it has been
+ * moved to another group, returns the group it was in before. */
+static PurpleGroup *
+buddy_index_add (HazeContactList *self,
+    TpHandle handle,
+    PurpleBuddy *buddy)
+{
+  HazeContactListPrivate *priv = self->priv;
+  PurpleGroup *old_group, *group;
+
+  /* If the index hasn't been built yet, it will include this buddy when it
+   * is. */
+  if (priv->buddies == NULL)
+    return NULL;
+
+  old_group = g_hash_table_lookup (priv->buddy_groups, buddy);
+
+  if (old_group == NULL)
+    {
+      index_insert (self, handle, buddy);
+      return NULL;
+    }
+
+  /* Moving a buddy to another group emits buddy-added again. */
+  group = purple_buddy_get_group (buddy);
+
+  if (group == old_group)
+    return NULL;
+
+  g_hash_table_insert (priv->buddy_groups, buddy, group);
+  group_index_remove (self, old_group, handle);
+  tp_handle_set_add (group_index_ensure (self, purple_group_get_name (group)),
+      handle);
+  return old_group;
+}
+
+/* Returns TRUE if @buddy was the last instance of @handle. */
+static gboolean
+buddy_index_remove (HazeContactList *self,
+    TpHandle handle,
+    PurpleBuddy *buddy)
+{
+  HazeContactListPrivate *priv = self->priv;
+  gpointer key = GUINT_TO_POINTER (handle);
+  GSList *buddies = g_hash_table_lookup (ensure_buddy_index (self), key);
+  PurpleGroup *group = g_hash_table_lookup (priv->buddy_groups, buddy);
+
+  g_hash_table_steal (priv->buddies, key);
+  buddies = g_slist_remove (buddies, buddy);
+
+  if (buddies != NULL)
+    g_hash_table_insert (priv->buddies, key, buddies);
+
+  if (group != NULL)
+    {
+      g_hash_table_remove (priv->buddy_groups, buddy);
+      group_index_remove (self, group, handle);
+    }
+
+  return (buddies == NULL);
+}
+
+/* Makes sure @group_name exists, both in libpurple and as far as
+ * TpBaseContactList is concerned. */
+static PurpleGroup *
+ensure_group (HazeContactList *self,
+    const gchar *group_name)
+{
+  /* This actually has "ensure" semantics, and doesn't return a ref */
+  PurpleGroup *group = purple_group_new (group_name);
+
+  g_return_val_if_fail (group != NULL, NULL);
+
+  ensure_buddy_index (self);
+  group_index_ensure (self, purple_group_get_name (group));
+
+  /* We have to reassure the TpBaseContactList that the group exists,
+   * because libpurple doesn't have a group-added signal */
+  tp_base_contact_list_groups_created ((TpBaseContactList *) self,
+      &group_name, 1);
+
+  return group;
+}
+
+/* Adds a buddy for each of @contacts to @group (or the default group if
+ * %NULL) which isn't already in it, and tells the server about them all in
+ * one go. */
+static void
+add_buddies (HazeContactList *self,
+    TpHandleSet *contacts,
+    PurpleGroup *group)
+{
+  HazeConnection *conn = self->priv->conn;
+  PurpleAccount *account = conn->account;
+  TpIntsetFastIter iter;
+  TpHandle handle;
+  GList *added = NULL;
+
+  batch_begin (self);
+  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (contacts));
+
+  while (tp_intset_fast_iter_next (&iter, &handle))
+    {
+      const gchar *bname = haze_connection_handle_inspect (conn,
+          TP_HANDLE_TYPE_CONTACT, handle);
+      PurpleBuddy *buddy;
+
+      g_assert (bname != NULL);
+
+      if (group == NULL)
+        {
+          /* If the buddy already exists, then it's already on the
+           * subscribe list. */
+          if (peek_buddies (self, handle) != NULL)
+            continue;
+        }
+      else if (purple_find_buddy_in_group (account, bname, group) != NULL)
+        {
+          continue;
+        }
+
+      buddy = purple_buddy_new (account, bname, NULL);
+
+      /* FIXME: This emits buddy-added at once, so a buddy will never be
+       * on the pending list.  It doesn't look like libpurple even has
+       * the concept of a pending buddy.  Sigh.
+       */
+      purple_blist_add_buddy (buddy, NULL, group, NULL);
+      added = g_list_prepend (added, buddy);
+    }
+
+  /* This uses the prpl's add_buddies if it has one, and add_buddy for each
+   * buddy if not. */
+  if (added != NULL)
+    purple_account_add_buddies (account, added);
+
+  g_list_free (added);
+  batch_end (self);
+}
+
+/* Removes @buddies (a list of PurpleBuddy) from the buddy list, and tells
+ * the server about them all in one go. */
+static void
+remove_buddies (HazeContactList *self,
+    GList *buddies)
+{
+  PurpleAccount *account = self->priv->conn->account;
+  GList *groups = NULL;
+  GList *l;
+
+  if (buddies == NULL)
+    return;
+
+  for (l = buddies; l != NULL; l = l->next)
+    groups = g_list_prepend (groups, purple_buddy_get_group (l->data));
+
+  groups = g_list_reverse (groups);
+  purple_account_remove_buddies (account, buddies, groups);
+  g_list_free (groups);
+
+  batch_begin (self);
+
+  for (l = buddies; l != NULL; l = l->next)
+    purple_blist_remove_buddy (l->data);
+
+  batch_end (self);
+}
+
+static TpHandleSet *
+haze_contact_list_dup_contacts (TpBaseContactList *cl)
+{
+  HazeContactList *self = HAZE_CONTACT_LIST (cl);
+  /* The list initially contains anyone we're definitely publishing to.
+   * Because libpurple, that's only people whose request we accepted during
+   * this session :-( */
+  TpHandleSet *handles = tp_handle_set_copy (self->priv->publishing_to);
+  GHashTableIter hash_iter;
+  gpointer k;
+
+  /* Also include anyone on our buddy list */
+  g_hash_table_iter_init (&hash_iter, ensure_buddy_index (self));
+
+  while (g_hash_table_iter_next (&hash_iter, &k, NULL))
+    {
+      tp_handle_set_add (handles, GPOINTER_TO_UINT (k));
+    }
+
+  /* Also include anyone with an outstanding request */
+  g_hash_table_iter_init (&hash_iter, self->priv->pending_publish_requests);
+
+  while (g_hash_table_iter_next (&hash_iter, &k, NULL))
+    {
+      tp_handle_set_add (handles, GPOINTER_TO_UINT (k));
+    }
+
+  /* Also include anyone who was on the list last time, until we know
+   * better */
+  g_hash_table_iter_init (&hash_iter, self->priv->provisional);
+
+  while (g_hash_table_iter_next (&hash_iter, &k, NULL))
+    {
+      tp_handle_set_add (handles, GPOINTER_TO_UINT (k));
+    }
+
+  return handles;
+}
+
+static void
+haze_contact_list_dup_states (TpBaseContactList *cl,
+    TpHandle contact,
+    TpSubscriptionState *subscribe_out,
+    TpSubscriptionState *publish_out,
+    gchar **publish_request_out)
+{
+  HazeContactList *self = HAZE_CONTACT_LIST (cl);
+  GSList *buddies = peek_buddies (self, contact);
+  TpSubscriptionState pub, sub;
+  PublishRequestData *pub_req = g_hash_table_lookup (
+      self->priv->pending_publish_requests, GUINT_TO_POINTER (contact));
+
+  if (publish_request_out != NULL)
+    *publish_request_out = NULL;
+
+  if (buddies != NULL ||
+      g_hash_table_lookup (self->priv->provisional,
+          GUINT_TO_POINTER (contact)) != NULL)
+    {
+      /* Well, it's on the contact list. Are we subscribed to its presence?
+       * Who knows? Let's assume we are. */
+      sub = TP_SUBSCRIPTION_STATE_YES;
+    }
+  else
+    {
+      /* We're definitely not subscribed. */
+      sub = TP_SUBSCRIPTION_STATE_NO;
+    }
+
+  if (pub_req != NULL)
+    {
+      pub = TP_SUBSCRIPTION_STATE_ASK;
+
+      if (publish_request_out != NULL)
+        *publish_request_out = g_strdup (pub_req->message);
+    }
+  else if (tp_handle_set_is_member (self->priv->publishing_to, contact))
+    {
+      pub = TP_SUBSCRIPTION_STATE_YES;
+    }
+  else if (tp_handle_set_is_member (self->priv->not_publishing_to, contact))
+    {
+      pub = TP_SUBSCRIPTION_STATE_NO;
+    }
+  else
+    {
+      pub = TP_SUBSCRIPTION_STATE_UNKNOWN;
+    }
+
+  if (subscribe_out != NULL)
+    *subscribe_out = sub;
+
+  if (publish_out != NULL)
+    *publish_out = pub;
+}
+
+static void
+haze_contact_list_class_init (HazeContactListClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    TpBaseContactListClass *parent_class = TP_BASE_CONTACT_LIST_CLASS (klass);
+
+    object_class->constructor = haze_contact_list_constructor;
+
+    object_class->dispose = haze_contact_list_dispose;
+    object_class->finalize = haze_contact_list_finalize;
+
+    parent_class->dup_contacts = haze_contact_list_dup_contacts;
+    parent_class->dup_states = haze_contact_list_dup_states;
+    /* we assume the contact list does persist, which is the default */
+
+    g_type_class_add_private (object_class,
+                              sizeof(HazeContactListPrivate));
+
+    purple_signal_connect (purple_blist_get_handle(), "buddy-added",
+                           klass, PURPLE_CALLBACK(buddy_added_cb), NULL);
+    purple_signal_connect (purple_blist_get_handle(), "buddy-removed",
+                           klass, PURPLE_CALLBACK(buddy_removed_cb), NULL);
+    purple_signal_connect (purple_accounts_get_handle (), "account-removed",
+                           klass, PURPLE_CALLBACK (account_removed_cb), NULL);
+}
+
+static void
+buddy_added (HazeContactList *contact_list,
+             PurpleBuddy *buddy,
+             TpHandle handle)
+{
+    const char *group_name;
+    PurpleGroup *old_group;
+    TpHandleSet *members;
+    gboolean was_member;
+
+    group_name = purple_group_get_name (purple_buddy_get_group (buddy));
+
+    contact_list->priv->last_buddy_added = g_get_monotonic_time ();
+
+    /* Contacts from the last roster have already been announced, in the
+     * groups they were in then, so only differences need signalling. */
+    members = g_hash_table_lookup (contact_list->priv->groups, group_name);
+    was_member = (members != NULL &&
+        tp_handle_set_is_member (members, handle));
+
+    old_group = buddy_index_add (contact_list, handle, buddy);
+
+    if (g_hash_table_lookup (contact_list->priv->provisional,
+            GUINT_TO_POINTER (handle)) == NULL)
+        queue_contact_changed (contact_list, handle);
+
+    if (!was_member)
+        queue_group_added (contact_list, handle, group_name);
+
+    if (old_group != NULL)
+    {
+        TpHandleSet *old_members = g_hash_table_lookup (
+            contact_list->priv->groups, purple_group_get_name (old_group));
+
+        if (old_members == NULL ||
+            !tp_handle_set_is_member (old_members, handle))
+            queue_group_removed (contact_list, handle,
+                purple_group_get_name (old_group));
+    }
+}
+
+static void
+buddy_added_cb (PurpleBuddy *buddy, gpointer unused)
+{
+    HazeConnection *conn;
+    HazeContactList *contact_list;
+    TpHandle handle;
+
+    /* Buddies loaded from a persistent buddy list belong to accounts with no
+     * connection yet. */
+    if (buddy->account->ui_data == NULL)
+        return;
+
+    conn = ACCOUNT_GET_HAZE_CONNECTION (buddy->account);
+    contact_list = conn->contact_list;
+
+    if (contact_list->priv->dispose_has_run)
+        return;
+
+    handle = haze_connection_get_buddy_handle (conn, buddy);
+
+    if (G_UNLIKELY (handle == 0))
+        return;
+
+    buddy_added (contact_list, buddy, handle);
+}
+
+static void
+buddy_removed (HazeContactList *contact_list,
+               PurpleBuddy *buddy,
+               TpHandle handle)
+{
+    const char *group_name;
+
+    group_name = purple_group_get_name (purple_buddy_get_group (buddy));
+
+    queue_group_removed (contact_list, handle, group_name);
+
+    if (buddy_index_remove (contact_list, handle, buddy))
+    {
+        roster_forget (contact_list, handle);
+        queue_contact_removed (contact_list, handle);
+    }
+}
+
+static void
+buddy_removed_cb (PurpleBuddy *buddy, gpointer unused)
+{
+    HazeConnection *conn;
+    TpBaseConnection *base_conn;
+    TpHandle handle;
+
+    if (buddy->account->ui_data == NULL)
+        return;
+
+    conn = ACCOUNT_GET_HAZE_CONNECTION (buddy->account);
+    base_conn = TP_BASE_CONNECTION (conn);
+
+    /* Every buddy gets removed after disconnection, because the PurpleAccount
+     * gets deleted.  So let's ignore removals when we're offline. (The buddy
+     * index isn't used once we're offline, so it doesn't matter that it's
+     * left pointing at the removed buddies.)
+     */
+    if (base_conn->status == TP_CONNECTION_STATUS_DISCONNECTED)
+        return;
+
+    handle = haze_connection_get_buddy_handle (conn, buddy);
+
+    if (G_UNLIKELY (handle == 0))
+        return;
+
+    buddy_removed (conn->contact_list, buddy, handle);
+}
+
+/**
+ * haze_contact_list_buddy_renamed:
+ * @self: the contact list
+ * @buddy: a buddy which a prpl has renamed with purple_blist_rename_buddy(),
+ *         which no signal announces
+ * @old_handle: the handle @buddy had before, or 0
+ * @new_handle: the handle it has now, or 0
+ *
+ * Moves @buddy from one contact to the other, as if it had been removed and
+ * added again.
+ */
+void
+haze_contact_list_buddy_renamed (HazeContactList *self,
+                                 PurpleBuddy *buddy,
+                                 TpHandle old_handle,
+                                 TpHandle new_handle)
+{
+    TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
+
+    if (self->priv->dispose_has_run ||
+        base_conn->status == TP_CONNECTION_STATUS_DISCONNECTED)
+        return;
+
+    DEBUG ("buddy %s is now handle %u rather than %u",
+        purple_buddy_get_name (buddy), new_handle, old_handle);
+
+    if (old_handle != 0)
+        buddy_removed (self, buddy, old_handle);
+
+    if (new_handle != 0)
+        buddy_added (self, buddy, new_handle);
+}
+
+static gboolean
+is_on_list (HazeContactList *self,
+    TpHandle handle)
+{
+  HazeContactListPrivate *priv = self->priv;
+
+  /* The same people as haze_contact_list_dup_contacts() */
+  return (peek_buddies (self, handle) != NULL ||
+      g_hash_table_lookup (priv->provisional,
+          GUINT_TO_POINTER (handle)) != NULL ||
+      tp_handle_set_is_member (priv->publishing_to, handle) ||
+      g_hash_table_lookup (priv->pending_publish_requests,
+          GUINT_TO_POINTER (handle)) != NULL);
+}
+
+/* Some protocols only send the roster once the connection is up, so each
+ * buddy on it is added, and would be announced, one at a time. Unless the
+ * buddy list is kept in a persistent state directory, it's lost when the
+ * account disconnects, so the same happens again on every reconnection.
+ *
+ * To avoid that, the last roster each account had is kept in memory, and
+ * when the account reconnects, the contacts on it are included in the
+ * initial contact list, in the groups they were in then. As the roster
+ * arrives, only contacts who are new or in new groups are announced; once
+ * no buddies have been added for ROSTER_SETTLE_QUIET_MSEC, or after
+ * ROSTER_SETTLE_MAX_SEC regardless, any contacts and groups from the last
+ * roster which haven't reappeared are removed.
+ */
+#define ROSTER_SETTLE_QUIET_MSEC 2000
+#define ROSTER_SETTLE_MAX_SEC 30
+
+/* Maps roster_key() (owned) to a GHashTable mapping contacts' names (owned)
+ * to GStrvs of their groups. */
+static GHashTable *last_rosters = NULL;
+
+static gchar *
+roster_key (PurpleAccount *account)
+{
+  return g_strdup_printf ("%s\n%s", purple_account_get_protocol_id (account),
+      purple_account_get_username (account));
+}
+
+/* Connections delete their accounts as they finish, after saving the
+ * roster; those accounts still have ui_data set. An account removed by any
+ * other means isn't coming back, so neither is its roster. */
+static void
+account_removed_cb (PurpleAccount *account,
+                    gpointer unused)
+{
+  gchar *key;
+
+  if (last_rosters == NULL || account->ui_data != NULL)
+    return;
+
+  key = roster_key (account);
+  g_hash_table_remove (last_rosters, key);
+  g_free (key);
+}
+
+/* Frees the rosters kept for accounts' next connections. */
+void
+haze_contact_list_forget_rosters (void)
+{
+  tp_clear_pointer (&last_rosters, g_hash_table_unref);
+}
+
+static void
+roster_save (HazeContactList *self)
+{
+  HazeContactListPrivate *priv = self->priv;
+  TpHandleRepoIface *contact_repo;
+  GHashTable *contact_groups, *roster;
+  GHashTableIter iter;
+  gpointer k, v;
+
+  /* Don't overwrite the last roster with an incomplete one */
+  if (priv->version == 0 || priv->buddies == NULL ||
+      haze_state_dir_is_persistent ())
+    return;
+
+  contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
+
+  /* Maps handles to GPtrArrays of group names */
+  contact_groups = g_hash_table_new (NULL, NULL);
+  g_hash_table_iter_init (&iter, priv->groups);
+
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      TpIntsetFastIter members;
+      TpHandle handle;
+
+      tp_intset_fast_iter_init (&members, tp_handle_set_peek (v));
+
+      while (tp_intset_fast_iter_next (&members, &handle))
+        {
+          GPtrArray *groups = g_hash_table_lookup (contact_groups,
+              GUINT_TO_POINTER (handle));
+
+          if (groups == NULL)
+            {
+              groups = g_ptr_array_new ();
+              g_hash_table_insert (contact_groups, GUINT_TO_POINTER (handle),
+                  groups);
+            }
+
+          g_ptr_array_add (groups, g_strdup (k));
+        }
+    }
+
+  roster = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      (GDestroyNotify) g_strfreev);
+  g_hash_table_iter_init (&iter, contact_groups);
 
-      if (G_LIKELY (handle != 0))
-        tp_handle_set_add (handles, handle);
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      g_ptr_array_add (v, NULL);
+      g_hash_table_insert (roster,
+          g_strdup (tp_handle_inspect (contact_repo, GPOINTER_TO_UINT (k))),
+          g_ptr_array_free (v, FALSE));
     }
 
-  g_slist_free (buddies);
+  g_hash_table_unref (contact_groups);
 
-  /* Also include anyone with an outstanding request */
-  g_hash_table_iter_init (&hash_iter, self->priv->pending_publish_requests);
+  if (last_rosters == NULL)
+    last_rosters = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+        (GDestroyNotify) g_hash_table_unref);
 
-  while (g_hash_table_iter_next (&hash_iter, &k, NULL))
+  g_hash_table_insert (last_rosters, roster_key (priv->conn->account),
+      roster);
+}
+
+static gboolean
+buddies_in_group (GSList *buddies,
+    const gchar *group_name)
+{
+  for (; buddies != NULL; buddies = buddies->next)
     {
-      tp_handle_set_add (handles, GPOINTER_TO_UINT (k));
+      PurpleGroup *group = purple_buddy_get_group (buddies->data);
+
+      if (!tp_strdiff (purple_group_get_name (group), group_name))
+        return TRUE;
     }
 
-  return handles;
+  return FALSE;
 }
 
+/* Removes @handle from those of @groups (a GStrv) which none of its buddies
+ * are in, signalling it if @signal is set, and adds any which are now empty,
+ * and don't exist in libpurple, to @emptied if it is non-%NULL. */
 static void
-haze_contact_list_dup_states (TpBaseContactList *cl,
-    TpHandle contact,
-    TpSubscriptionState *subscribe_out,
-    TpSubscriptionState *publish_out,
-    gchar **publish_request_out)
+drop_provisional_groups (HazeContactList *self,
+    TpHandle handle,
+    gchar **groups,
+    gboolean signal,
+    GPtrArray *emptied)
 {
-  HazeContactList *self = HAZE_CONTACT_LIST (cl);
-  const gchar *bname = haze_connection_handle_inspect (self->priv->conn,
-      TP_HANDLE_TYPE_CONTACT, contact);
-  PurpleBuddy *buddy = purple_find_buddy (self->priv->conn->account, bname);
-  TpSubscriptionState pub, sub;
-  PublishRequestData *pub_req = g_hash_table_lookup (
-      self->priv->pending_publish_requests, GUINT_TO_POINTER (contact));
+  GSList *buddies = peek_buddies (self, handle);
+  guint i;
 
-  if (publish_request_out != NULL)
-    *publish_request_out = NULL;
-
-  if (buddy != NULL)
-    {
-      /* Well, it's on the contact list. Are we subscribed to its presence?
-       * Who knows? Let's assume we are. */
-      sub = TP_SUBSCRIPTION_STATE_YES;
-    }
-  else
+  for (i = 0; groups[i] != NULL; i++)
     {
-      /* We're definitely not subscribed. */
-      sub = TP_SUBSCRIPTION_STATE_NO;
-    }
+      TpHandleSet *members = g_hash_table_lookup (self->priv->groups,
+          groups[i]);
 
-  if (pub_req != NULL)
-    {
-      pub = TP_SUBSCRIPTION_STATE_ASK;
+      if (members == NULL || buddies_in_group (buddies, groups[i]))
+        continue;
 
-      if (publish_request_out != NULL)
-        *publish_request_out = g_strdup (pub_req->message);
-    }
-  else if (tp_handle_set_is_member (self->priv->publishing_to, contact))
-    {
-      pub = TP_SUBSCRIPTION_STATE_YES;
-    }
-  else if (tp_handle_set_is_member (self->priv->not_publishing_to, contact))
-    {
-      pub = TP_SUBSCRIPTION_STATE_NO;
-    }
-  else
-    {
-      pub = TP_SUBSCRIPTION_STATE_UNKNOWN;
+      if (!tp_handle_set_remove (members, handle))
+        continue;
+
+      if (signal)
+        queue_group_removed (self, handle, groups[i]);
+
+      if (emptied != NULL && tp_handle_set_is_empty (members) &&
+          purple_find_group (groups[i]) == NULL)
+        g_ptr_array_add (emptied, g_strdup (groups[i]));
     }
+}
 
-  if (subscribe_out != NULL)
-    *subscribe_out = sub;
+/* Forgets that @handle was on the last roster, without signalling anything;
+ * returns %TRUE if it was. */
+static gboolean
+roster_forget (HazeContactList *self,
+    TpHandle handle)
+{
+  gchar **groups = g_hash_table_lookup (self->priv->provisional,
+      GUINT_TO_POINTER (handle));
 
-  if (publish_out != NULL)
-    *publish_out = pub;
+  if (groups == NULL)
+    return FALSE;
+
+  drop_provisional_groups (self, handle, groups, FALSE, NULL);
+  g_hash_table_remove (self->priv->provisional, GUINT_TO_POINTER (handle));
+  return TRUE;
 }
 
 static void
-haze_contact_list_class_init (HazeContactListClass *klass)
+roster_settle (HazeContactList *self)
 {
-    GObjectClass *object_class = G_OBJECT_CLASS (klass);
-    TpBaseContactListClass *parent_class = TP_BASE_CONTACT_LIST_CLASS (klass);
+  HazeContactListPrivate *priv = self->priv;
+  GHashTable *provisional = priv->provisional;
+  GPtrArray *emptied = g_ptr_array_new_with_free_func (g_free);
+  GHashTableIter iter;
+  gpointer k, v;
+  guint i;
 
-    object_class->constructor = haze_contact_list_constructor;
+  DEBUG ("%u contacts from the last roster still to be confirmed",
+      g_hash_table_size (provisional));
 
-    object_class->dispose = haze_contact_list_dispose;
-    object_class->finalize = haze_contact_list_finalize;
+  /* Signalling may re-enter us, so start afresh first */
+  priv->provisional = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) g_strfreev);
 
-    parent_class->dup_contacts = haze_contact_list_dup_contacts;
-    parent_class->dup_states = haze_contact_list_dup_states;
-    /* we assume the contact list does persist, which is the default */
+  batch_begin (self);
+  g_hash_table_iter_init (&iter, provisional);
 
-    g_type_class_add_private (object_class,
-                              sizeof(HazeContactListPrivate));
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      TpHandle handle = GPOINTER_TO_UINT (k);
+      gboolean gone = !is_on_list (self, handle);
 
-    purple_signal_connect (purple_blist_get_handle(), "buddy-added",
-                           klass, PURPLE_CALLBACK(buddy_added_cb), NULL);
-    purple_signal_connect (purple_blist_get_handle(), "buddy-removed",
-                           klass, PURPLE_CALLBACK(buddy_removed_cb), NULL);
+      drop_provisional_groups (self, handle, v, !gone, emptied);
+
+      if (gone)
+        queue_contact_removed (self, handle);
+    }
+
+  batch_end (self);
+
+  /* Now that everyone has left them, get rid of groups which only existed on
+   * the last roster. */
+  for (i = 0; i < emptied->len; i++)
+    {
+      const gchar *group_name = g_ptr_array_index (emptied, i);
+      TpHandleSet *members = g_hash_table_lookup (priv->groups, group_name);
+
+      if (members != NULL && tp_handle_set_is_empty (members))
+        {
+          g_hash_table_remove (priv->groups, group_name);
+          tp_base_contact_list_groups_removed ((TpBaseContactList *) self,
+              &group_name, 1);
+        }
+    }
+
+  g_ptr_array_unref (emptied);
+  g_hash_table_unref (provisional);
 }
 
-static void
-buddy_added_cb (PurpleBuddy *buddy, gpointer unused)
+static gboolean
+roster_settle_cb (gpointer data)
 {
-    HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (buddy->account);
-    HazeContactList *contact_list = conn->contact_list;
-    TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
-    TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
-        base_conn, TP_HANDLE_TYPE_CONTACT);
-    const gchar *name = purple_buddy_get_name (buddy);
-    TpHandle handle = tp_handle_ensure (contact_repo, name, NULL, NULL);
-    const char *group_name;
+  HazeContactList *self = data;
+  HazeContactListPrivate *priv = self->priv;
+  gint64 now = g_get_monotonic_time ();
 
-    tp_base_contact_list_one_contact_changed (
-        (TpBaseContactList *) contact_list, handle);
+  if (now < priv->settle_deadline &&
+      now - priv->last_buddy_added < ROSTER_SETTLE_QUIET_MSEC * 1000)
+    return TRUE;
 
-    group_name = purple_group_get_name (purple_buddy_get_group (buddy));
-    tp_base_contact_list_one_contact_groups_changed (
-        (TpBaseContactList *) contact_list, handle, &group_name, 1, NULL, 0);
+  priv->settle_id = 0;
+  roster_settle (self);
+  return FALSE;
 }
 
 static void
-buddy_removed_cb (PurpleBuddy *buddy, gpointer unused)
+roster_restore (HazeContactList *self)
 {
-    HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (buddy->account);
-    TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
-    HazeContactList *contact_list;
-    TpHandleRepoIface *contact_repo;
-    TpHandle handle;
-    const char *group_name, *buddy_name;
-    GSList *buddies, *l;
-    gboolean last_instance = TRUE;
+  HazeContactListPrivate *priv = self->priv;
+  TpHandleRepoIface *contact_repo;
+  GHashTable *roster = NULL;
+  GHashTableIter iter;
+  gpointer k, v;
+  gchar *key;
+  gint64 now;
 
-    /* Every buddy gets removed after disconnection, because the PurpleAccount
-     * gets deleted.  So let's ignore removals when we're offline.
-     */
-    if (base_conn->status == TP_CONNECTION_STATUS_DISCONNECTED)
-        return;
+  if (last_rosters == NULL)
+    return;
 
-    contact_list = conn->contact_list;
-    contact_repo = tp_base_connection_get_handles (base_conn,
-        TP_HANDLE_TYPE_CONTACT);
+  key = roster_key (priv->conn->account);
 
-    buddy_name = purple_buddy_get_name (buddy);
-    handle = tp_handle_ensure (contact_repo, buddy_name, NULL, NULL);
-    group_name = purple_group_get_name (purple_buddy_get_group (buddy));
+  if (g_hash_table_lookup_extended (last_rosters, key, NULL,
+        (gpointer *) &roster))
+    g_hash_table_steal (last_rosters, key);
+
+  g_free (key);
 
-    tp_base_contact_list_one_contact_groups_changed (
-        (TpBaseContactList *) contact_list, handle, NULL, 0, &group_name, 1);
+  if (roster == NULL)
+    return;
 
-    buddies = purple_find_buddies (conn->account, buddy_name);
+  contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
+  ensure_buddy_index (self);
+  g_hash_table_iter_init (&iter, roster);
 
-    for (l = buddies; l != NULL; l = l->next)
+  while (g_hash_table_iter_next (&iter, &k, &v))
     {
-        if (l->data != buddy)
-        {
-            last_instance = FALSE;
-            break;
-        }
-    }
+      TpHandle handle = tp_handle_ensure (contact_repo, k, NULL, NULL);
+      gchar **groups = v;
+      guint i;
 
-    g_slist_free (buddies);
+      /* If it's already back, what we know now is more up to date */
+      if (handle == 0 || peek_buddies (self, handle) != NULL)
+        continue;
 
-    if (last_instance)
-    {
-        tp_base_contact_list_one_contact_removed (
-            (TpBaseContactList *) contact_list, handle);
+      for (i = 0; groups[i] != NULL; i++)
+        tp_handle_set_add (group_index_ensure (self, groups[i]), handle);
+
+      g_hash_table_insert (priv->provisional, GUINT_TO_POINTER (handle),
+          g_strdupv (groups));
     }
+
+  g_hash_table_unref (roster);
+
+  if (g_hash_table_size (priv->provisional) == 0)
+    return;
+
+  DEBUG ("restored %u contacts from the last roster",
+      g_hash_table_size (priv->provisional));
+
+  now = g_get_monotonic_time ();
+  priv->last_buddy_added = now;
+  priv->settle_deadline = now + ROSTER_SETTLE_MAX_SEC * G_USEC_PER_SEC;
+  priv->settle_id = g_timeout_add (ROSTER_SETTLE_QUIET_MSEC,
+      roster_settle_cb, self);
 }
 
 
@@ -399,13 +1611,17 @@ haze_contact_list_accept_publish_request (HazeContactList *self,
     return;
 
   DEBUG ("allowing publish request for %s", bname);
-  request_data->allow(request_data->data);
+
+  /* If the request was only remembered from a previous connection, there's
+   * nobody to tell, but the decision is still remembered. */
+  if (request_data->allow != NULL)
+    request_data->allow(request_data->data);
 
   tp_handle_set_add (self->priv->publishing_to, handle);
   remove_pending_publish_request (self, handle);
+  publish_store_sync (self);
 
-  tp_base_contact_list_one_contact_changed ((TpBaseContactList *) self,
-      handle);
+  queue_contact_changed (self, handle);
 }
 
 static void
@@ -441,13 +1657,15 @@ haze_contact_list_reject_publish_request (HazeContactList *self,
     return;
 
   DEBUG ("denying publish request for %s", bname);
-  request_data->deny(request_data->data);
+
+  if (request_data->deny != NULL)
+    request_data->deny(request_data->data);
 
   tp_handle_set_add (self->priv->not_publishing_to, handle);
   remove_pending_publish_request (self, handle);
+  publish_store_sync (self);
 
-  tp_base_contact_list_one_contact_changed ((TpBaseContactList *) self,
-      handle);
+  queue_contact_changed (self, handle);
 }
 
 
@@ -488,9 +1706,9 @@ haze_request_authorize (PurpleAccount *account,
      * already publishing to them? */
     tp_handle_set_remove (self->priv->publishing_to, remote_handle);
     tp_handle_set_add (self->priv->not_publishing_to, remote_handle);
+    publish_store_sync (self);
 
-    tp_base_contact_list_one_contact_changed ((TpBaseContactList *) self,
-        remote_handle);
+    queue_contact_changed (self, remote_handle);
 
     return request_data;
 }
@@ -513,35 +1731,231 @@ haze_close_account_request (gpointer request_data_)
     tp_handle_set_add (self->priv->not_publishing_to, handle);
     remove_pending_publish_request (self, handle);
 
-    tp_base_contact_list_one_contact_changed ((TpBaseContactList *) self,
-        handle);
+    /* libpurple cancels every request when the account disconnects; they
+     * are still outstanding as far as the publish store is concerned. */
+    if (TP_BASE_CONNECTION (self->priv->conn)->status !=
+        TP_CONNECTION_STATUS_DISCONNECTED)
+        publish_store_sync (self);
+
+    queue_contact_changed (self, handle);
 
     g_object_unref (self);
 }
 
+/* The publish store records, for each account, which contacts it has
+ * decided to publish its presence to or not, and any requests it hasn't
+ * answered yet, as lists of contact identifiers; see
+ * haze_state_get_publish_store(). */
+static gchar *
+publish_store_group (PurpleAccount *account)
+{
+  gchar *group = g_strdup_printf ("%s:%s",
+      purple_account_get_protocol_id (account),
+      purple_account_get_username (account));
+
+  /* These aren't allowed in key file group names */
+  return g_strdelimit (group, "[]\n", '_');
+}
+
+static gboolean
+has_publish_state (HazeContactList *self,
+    TpHandle handle)
+{
+  HazeContactListPrivate *priv = self->priv;
+
+  return (tp_handle_set_is_member (priv->publishing_to, handle) ||
+      tp_handle_set_is_member (priv->not_publishing_to, handle) ||
+      g_hash_table_lookup (priv->pending_publish_requests,
+          GUINT_TO_POINTER (handle)) != NULL);
+}
+
+/* Merges the publish store's idea of this account's publish states with
+ * what has happened so far this session, which takes precedence. */
+static void
+publish_store_load (HazeContactList *self)
+{
+  HazeContactListPrivate *priv = self->priv;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
+  GKeyFile *store;
+  gchar *group;
+  gchar **publish, **deny, **ask, **messages;
+  gsize n_messages = 0;
+  guint i;
+
+  if (priv->publish_store_loaded)
+    return;
+
+  priv->publish_store_loaded = TRUE;
+  store = haze_state_get_publish_store ();
+
+  if (store == NULL)
+    return;
+
+  group = publish_store_group (priv->conn->account);
+  publish = g_key_file_get_string_list (store, group, "publish", NULL, NULL);
+  deny = g_key_file_get_string_list (store, group, "deny", NULL, NULL);
+  ask = g_key_file_get_string_list (store, group, "ask", NULL, NULL);
+  messages = g_key_file_get_string_list (store, group, "ask-message",
+      &n_messages, NULL);
+
+  for (i = 0; publish != NULL && publish[i] != NULL; i++)
+    {
+      TpHandle handle = tp_handle_ensure (contact_repo, publish[i], NULL,
+          NULL);
+
+      if (handle != 0 && !has_publish_state (self, handle))
+        tp_handle_set_add (priv->publishing_to, handle);
+    }
+
+  for (i = 0; deny != NULL && deny[i] != NULL; i++)
+    {
+      TpHandle handle = tp_handle_ensure (contact_repo, deny[i], NULL, NULL);
+
+      if (handle != 0 && !has_publish_state (self, handle))
+        tp_handle_set_add (priv->not_publishing_to, handle);
+    }
+
+  for (i = 0; ask != NULL && ask[i] != NULL; i++)
+    {
+      TpHandle handle = tp_handle_ensure (contact_repo, ask[i], NULL, NULL);
+      PublishRequestData *request_data;
+
+      if (handle == 0 || has_publish_state (self, handle))
+        continue;
+
+      /* With no callbacks, since libpurple doesn't know about it */
+      request_data = publish_request_data_new ();
+      request_data->handle = handle;
+      request_data->message = g_strdup (i < n_messages ? messages[i] : "");
+      g_hash_table_insert (priv->pending_publish_requests,
+          GUINT_TO_POINTER (handle), request_data);
+    }
+
+  g_strfreev (publish);
+  g_strfreev (deny);
+  g_strfreev (ask);
+  g_strfreev (messages);
+  g_free (group);
+
+  /* Save anything which happened before the store was loaded */
+  publish_store_sync (self);
+}
+
+static void
+set_store_list (GKeyFile *store,
+    const gchar *group,
+    const gchar *key,
+    GPtrArray *list)
+{
+  if (list->len == 0)
+    g_key_file_remove_key (store, group, key, NULL);
+  else
+    g_key_file_set_string_list (store, group, key,
+        (const gchar * const *) list->pdata, list->len);
+}
+
+/* Rewrites this account's entry in the publish store. Decisions are rare, so
+ * it's not worth doing anything cleverer. */
+static void
+publish_store_sync (HazeContactList *self)
+{
+  HazeContactListPrivate *priv = self->priv;
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (
+      (TpBaseConnection *) priv->conn, TP_HANDLE_TYPE_CONTACT);
+  GKeyFile *store;
+  GPtrArray *publish, *deny, *ask, *messages;
+  GHashTableIter hash_iter;
+  gpointer k, v;
+  TpIntsetFastIter iter;
+  TpHandle handle;
+  gchar *group;
+
+  /* Until the store is loaded, we'd overwrite what it knows */
+  if (!priv->publish_store_loaded)
+    return;
+
+  store = haze_state_get_publish_store ();
+
+  if (store == NULL)
+    return;
+
+  publish = g_ptr_array_new ();
+  deny = g_ptr_array_new ();
+  ask = g_ptr_array_new ();
+  messages = g_ptr_array_new ();
+
+  /* Outstanding requests take precedence, as in
+   * haze_contact_list_dup_states() */
+  g_hash_table_iter_init (&hash_iter, priv->pending_publish_requests);
+
+  while (g_hash_table_iter_next (&hash_iter, &k, &v))
+    {
+      PublishRequestData *request_data = v;
+
+      g_ptr_array_add (ask, (gchar *) tp_handle_inspect (contact_repo,
+            GPOINTER_TO_UINT (k)));
+      g_ptr_array_add (messages,
+          request_data->message != NULL ? request_data->message : "");
+    }
+
+  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (priv->publishing_to));
+
+  while (tp_intset_fast_iter_next (&iter, &handle))
+    {
+      if (g_hash_table_lookup (priv->pending_publish_requests,
+            GUINT_TO_POINTER (handle)) == NULL)
+        g_ptr_array_add (publish,
+            (gchar *) tp_handle_inspect (contact_repo, handle));
+    }
+
+  tp_intset_fast_iter_init (&iter,
+      tp_handle_set_peek (priv->not_publishing_to));
+
+  while (tp_intset_fast_iter_next (&iter, &handle))
+    {
+      if (g_hash_table_lookup (priv->pending_publish_requests,
+            GUINT_TO_POINTER (handle)) == NULL &&
+          !tp_handle_set_is_member (priv->publishing_to, handle))
+        g_ptr_array_add (deny,
+            (gchar *) tp_handle_inspect (contact_repo, handle));
+    }
+
+  group = publish_store_group (priv->conn->account);
+
+  if (publish->len == 0 && deny->len == 0 && ask->len == 0)
+    {
+      g_key_file_remove_group (store, group, NULL);
+    }
+  else
+    {
+      set_store_list (store, group, "publish", publish);
+      set_store_list (store, group, "deny", deny);
+      set_store_list (store, group, "ask", ask);
+      set_store_list (store, group, "ask-message", messages);
+    }
+
+  haze_state_publish_store_changed ();
+
+  g_free (group);
+  g_ptr_array_free (publish, TRUE);
+  g_ptr_array_free (deny, TRUE);
+  g_ptr_array_free (ask, TRUE);
+  g_ptr_array_free (messages, TRUE);
+}
+
 void
 haze_contact_list_request_subscription (HazeContactList *self,
     TpHandle handle,
     const gchar *message)
 {
-  PurpleAccount *account = self->priv->conn->account;
-  const gchar *bname = haze_connection_handle_inspect (self->priv->conn,
-      TP_HANDLE_TYPE_CONTACT, handle);
-  PurpleBuddy *buddy;
-
-  /* If the buddy already exists, then it should already be on the
-   * subscribe list.
-   */
-  g_assert (purple_find_buddy (account, bname) == NULL);
-
-  buddy = purple_buddy_new (account, bname, NULL);
+  TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base_conn,
+      TP_HANDLE_TYPE_CONTACT);
+  TpHandleSet *contacts = tp_handle_set_new_containing (contact_repo, handle);
 
-  /* FIXME: This emits buddy-added at once, so a buddy will never be
-   * on the pending list.  It doesn't look like libpurple even has
-   * the concept of a pending buddy.  Sigh.
-   */
-  purple_blist_add_buddy (buddy, NULL, NULL, NULL);
-  purple_account_add_buddy (account, buddy);
+  add_buddies (self, contacts, NULL);
+  tp_handle_set_destroy (contacts);
 }
 
 static void
@@ -552,13 +1966,8 @@ haze_contact_list_request_subscription_async (TpBaseContactList *cl,
     gpointer user_data)
 {
   HazeContactList *self = HAZE_CONTACT_LIST (cl);
-  TpIntsetFastIter iter;
-  TpHandle handle;
 
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (contacts));
-
-  while (tp_intset_fast_iter_next (&iter, &handle))
-    haze_contact_list_request_subscription (self, handle, message);
+  add_buddies (self, contacts, NULL);
 
   tp_simple_async_report_success_in_idle ((GObject *) self, callback,
       user_data, haze_contact_list_request_subscription_async);
@@ -574,34 +1983,55 @@ haze_contact_list_store_contacts_async (TpBaseContactList *cl,
       user_data);
 }
 
-void
-haze_contact_list_remove_contact (HazeContactList *self,
-    TpHandle handle)
+static void
+haze_contact_list_remove_contacts (HazeContactList *self,
+    TpHandleSet *contacts)
 {
-  PurpleAccount *account = self->priv->conn->account;
-  const gchar *bname = haze_connection_handle_inspect (self->priv->conn,
-      TP_HANDLE_TYPE_CONTACT, handle);
-  GSList *buddies, *l;
+  TpIntsetFastIter iter;
+  TpHandle handle;
+  GList *buddies = NULL;
+  GSList *l;
 
-  buddies = purple_find_buddies (account, bname);
-  /* buddies may be NULL, but that's a perfectly reasonable GSList */
+  batch_begin (self);
+  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (contacts));
 
   /* Removing a buddy from subscribe entails removing it from all
    * groups since you can't have a buddy without groups in libpurple.
    */
-  for (l = buddies; l != NULL; l = l->next)
+  while (tp_intset_fast_iter_next (&iter, &handle))
     {
-      PurpleBuddy *buddy = (PurpleBuddy *) l->data;
-      PurpleGroup *group = purple_buddy_get_group (buddy);
+      for (l = peek_buddies (self, handle); l != NULL; l = l->next)
+        buddies = g_list_prepend (buddies, l->data);
 
-      purple_account_remove_buddy (account, buddy, group);
-      purple_blist_remove_buddy (buddy);
+      /* If it was only on the last roster, there's nothing to remove from
+       * libpurple */
+      if (peek_buddies (self, handle) == NULL && roster_forget (self, handle))
+        queue_contact_removed (self, handle);
     }
 
+  remove_buddies (self, buddies);
+  g_list_free (buddies);
+
   /* Also decline any publication requests we might have had */
-  haze_contact_list_reject_publish_request (self, handle);
+  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (contacts));
+
+  while (tp_intset_fast_iter_next (&iter, &handle))
+    haze_contact_list_reject_publish_request (self, handle);
+
+  batch_end (self);
+}
+
+void
+haze_contact_list_remove_contact (HazeContactList *self,
+    TpHandle handle)
+{
+  TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base_conn,
+      TP_HANDLE_TYPE_CONTACT);
+  TpHandleSet *contacts = tp_handle_set_new_containing (contact_repo, handle);
 
-  g_slist_free (buddies);
+  haze_contact_list_remove_contacts (self, contacts);
+  tp_handle_set_destroy (contacts);
 }
 
 static void
@@ -611,13 +2041,8 @@ haze_contact_list_remove_contacts_async (TpBaseContactList *cl,
     gpointer user_data)
 {
   HazeContactList *self = HAZE_CONTACT_LIST (cl);
-  TpIntsetFastIter iter;
-  TpHandle handle;
-
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (contacts));
 
-  while (tp_intset_fast_iter_next (&iter, &handle))
-    haze_contact_list_remove_contact (self, handle);
+  haze_contact_list_remove_contacts (self, contacts);
 
   tp_simple_async_report_success_in_idle ((GObject *) self, callback,
       user_data, haze_contact_list_remove_contacts_async);
@@ -628,49 +2053,41 @@ haze_contact_list_add_to_group (HazeContactList *self,
     const gchar *group_name,
     TpHandle handle)
 {
-    HazeConnection *conn = self->priv->conn;
-    const gchar *bname =
-        haze_connection_handle_inspect (conn, TP_HANDLE_TYPE_CONTACT, handle);
-    PurpleBuddy *buddy;
-    /* This actually has "ensure" semantics, and doesn't return a ref */
-    PurpleGroup *group = purple_group_new (group_name);
-
-    /* We have to reassure the TpBaseContactList that the group exists,
-     * because libpurple doesn't have a group-added signal */
-    tp_base_contact_list_groups_created ((TpBaseContactList *) self,
-        &group_name, 1);
-
-    g_return_if_fail (group != NULL);
-
-    /* if the contact is in the group, we have nothing to do */
-    if (purple_find_buddy_in_group (conn->account, bname, group) != NULL)
-      return;
+  TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
+  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base_conn,
+      TP_HANDLE_TYPE_CONTACT);
+  PurpleGroup *group = ensure_group (self, group_name);
+  TpHandleSet *contacts;
 
-    buddy = purple_buddy_new (conn->account, bname, NULL);
+  g_return_if_fail (group != NULL);
 
-    /* FIXME: This causes it to be added to 'subscribed' too. */
-    purple_blist_add_buddy (buddy, NULL, group, NULL);
-    purple_account_add_buddy (conn->account, buddy);
+  /* FIXME: This causes it to be added to 'subscribed' too. */
+  contacts = tp_handle_set_new_containing (contact_repo, handle);
+  add_buddies (self, contacts, group);
+  tp_handle_set_destroy (contacts);
 }
 
-/* Prepare to @contacts from @group_name. If some of the @contacts are not in
- * any other group, add them to the fallback group, or if @group_name *is* the
- * fallback group, fail without doing anything else. */
+/* Removes @contacts from @group_name. Any of them for whom it's their only
+ * group are moved to the fallback group instead, or if @group_name *is* the
+ * fallback group, this fails without doing anything.
+ *
+ * Each contact's buddies are only looked at once, to work out which of them
+ * to remove and who needs moving; then the moves and removals are made in
+ * bulk, and signalled as one change. */
 static gboolean
-haze_contact_list_prep_remove_from_group (HazeContactList *self,
+remove_from_group (HazeContactList *self,
     const gchar *group_name,
     TpHandleSet *contacts,
     GError **error)
 {
-  HazeConnection *conn = self->priv->conn;
-  TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
+  TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
   TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base_conn,
       TP_HANDLE_TYPE_CONTACT);
-  PurpleAccount *account = conn->account;
   PurpleGroup *group = purple_find_group (group_name);
   TpIntsetFastIter iter;
   TpHandle handle;
   TpHandleSet *orphans;
+  GList *doomed = NULL;
 
   /* no such group? that was easy, we "already removed them" */
   if (group == NULL)
@@ -684,108 +2101,58 @@ haze_contact_list_prep_remove_from_group (HazeContactList *self,
     {
       gboolean is_in = FALSE;
       gboolean orphaned = TRUE;
-      GSList *buddies;
       GSList *l;
-      const gchar *bname =
-          haze_connection_handle_inspect (conn, TP_HANDLE_TYPE_CONTACT,
-              handle);
 
-      g_assert (bname != NULL);
-
-      buddies = purple_find_buddies (account, bname);
-
-      for (l = buddies; l != NULL; l = l->next)
+      /* The buddy might be in the group more than once, since this is
+       * possible in libpurple... */
+      for (l = peek_buddies (self, handle); l != NULL; l = l->next)
         {
-          PurpleGroup *their_group = purple_buddy_get_group (l->data);
-
-          if (their_group == group)
-            is_in = TRUE;
+          if (purple_buddy_get_group (l->data) == group)
+            {
+              is_in = TRUE;
+              doomed = g_list_prepend (doomed, l->data);
+            }
           else
-            orphaned = FALSE;
+            {
+              orphaned = FALSE;
+            }
         }
 
       if (is_in && orphaned)
         tp_handle_set_add (orphans, handle);
-
-      g_slist_free (buddies);
     }
 
+  batch_begin (self);
+
   /* If they're in the group and it's their last group, we need to move
    * them to the fallback group. If the group they're being removed from *is*
    * the fallback group, we just fail (before we've actually done anything). */
   if (!tp_handle_set_is_empty (orphans))
     {
       const gchar *def_name = haze_get_fallback_group ();
-      PurpleGroup *default_group = purple_group_new (def_name);
-
-      /* We might have just created that group; libpurple doesn't have
-       * a group-added signal, so tell TpBaseContactList about it */
-      tp_base_contact_list_groups_created ((TpBaseContactList *) self,
-          &def_name, 1);
+      /* We might have just created that group */
+      PurpleGroup *default_group = ensure_group (self, def_name);
 
       if (default_group == group)
         {
           g_set_error (error, TP_ERROR, TP_ERROR_NOT_AVAILABLE,
               "Contacts can't be removed from '%s' unless they are in "
               "another group", group->name);
+          batch_end (self);
+          tp_handle_set_destroy (orphans);
+          g_list_free (doomed);
           return FALSE;
         }
 
-      tp_intset_fast_iter_init (&iter, tp_handle_set_peek (orphans));
-
-      while (tp_intset_fast_iter_next (&iter, &handle))
-        {
-          const gchar *bname =
-              haze_connection_handle_inspect (conn, TP_HANDLE_TYPE_CONTACT,
-                  handle);
-
-          PurpleBuddy *copy = purple_buddy_new (conn->account, bname, NULL);
-          purple_blist_add_buddy (copy, NULL, default_group, NULL);
-          purple_account_add_buddy (account, copy);
-        }
+      add_buddies (self, orphans, default_group);
     }
 
-  return TRUE;
-}
-
-/* haze_contact_list_prep_remove_from_group() must succeed first. */
-static void
-haze_contact_list_remove_many_from_group (HazeContactList *self,
-    const gchar *group_name,
-    TpHandleSet *contacts)
-{
-  PurpleAccount *account = self->priv->conn->account;
-  PurpleGroup *group = purple_find_group (group_name);
-  TpIntsetFastIter iter;
-  TpHandle handle;
-
-  if (group == NULL)
-    return;
-
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (contacts));
-
-  while (tp_intset_fast_iter_next (&iter, &handle))
-    {
-      GSList *buddies;
-      GSList *l;
-      const gchar *bname = haze_connection_handle_inspect (self->priv->conn,
-          TP_HANDLE_TYPE_CONTACT, handle);
-
-      buddies = purple_find_buddies (account, bname);
-
-      /* See if the buddy was in the group more than once, since this is
-       * possible in libpurple... */
-      for (l = buddies; l != NULL; l = l->next)
-        {
-          PurpleGroup *their_group = purple_buddy_get_group (l->data);
+  remove_buddies (self, doomed);
+  batch_end (self);
 
-          if (their_group == group)
-            {
-              purple_account_remove_buddy (account, l->data, group);
-              purple_blist_remove_buddy (l->data);
-            }
-        }
-    }
+  tp_handle_set_destroy (orphans);
+  g_list_free (doomed);
+  return TRUE;
 }
 
 gboolean
@@ -800,11 +2167,7 @@ haze_contact_list_remove_from_group (HazeContactList *self,
   gboolean ok;
   TpHandleSet *contacts = tp_handle_set_new_containing (contact_repo, handle);
 
-  ok = haze_contact_list_prep_remove_from_group (self, group_name, contacts,
-      error);
-
-  if (ok)
-    haze_contact_list_remove_many_from_group (self, group_name, contacts);
+  ok = remove_from_group (self, group_name, contacts, error);
 
   tp_handle_set_destroy (contacts);
   return ok;
@@ -828,31 +2191,22 @@ haze_contact_list_mutable_init (TpMutableContactListInterface *vtable)
 }
 
 static GStrv
-haze_contact_list_dup_groups (TpBaseContactList *cl G_GNUC_UNUSED)
+haze_contact_list_dup_groups (TpBaseContactList *cl)
 {
-  PurpleBlistNode *node;
-  /* borrowed group name => NULL */
-  GHashTable *groups = g_hash_table_new (g_str_hash, g_str_equal);
+  HazeContactList *self = HAZE_CONTACT_LIST (cl);
   GHashTableIter iter;
   gpointer k;
   GPtrArray *arr;
 
-  for (node = purple_blist_get_root ();
-      node != NULL;
-      node = purple_blist_node_next (node, TRUE))
-    {
-      if (purple_blist_node_get_type (node) == PURPLE_BLIST_GROUP_NODE)
-        g_hash_table_insert (groups, PURPLE_GROUP (node)->name, NULL);
-    }
+  ensure_buddy_index (self);
 
-  arr = g_ptr_array_sized_new (g_hash_table_size (groups) + 1);
+  arr = g_ptr_array_sized_new (g_hash_table_size (self->priv->groups) + 1);
 
-  g_hash_table_iter_init (&iter, groups);
+  g_hash_table_iter_init (&iter, self->priv->groups);
 
   while (g_hash_table_iter_next (&iter, &k, NULL))
     g_ptr_array_add (arr, g_strdup (k));
 
-  g_hash_table_unref (groups);
   g_ptr_array_add (arr, NULL);
   return (GStrv) g_ptr_array_free (arr, FALSE);
 }
@@ -862,16 +2216,14 @@ haze_contact_list_dup_contact_groups (TpBaseContactList *cl,
     TpHandle contact)
 {
   HazeContactList *self = HAZE_CONTACT_LIST (cl);
-  const gchar *bname = haze_connection_handle_inspect (self->priv->conn,
-      TP_HANDLE_TYPE_CONTACT, contact);
-  GSList *buddies, *sl_iter;
+  GSList *buddies = peek_buddies (self, contact);
+  gchar **provisional = g_hash_table_lookup (self->priv->provisional,
+      GUINT_TO_POINTER (contact));
+  GSList *sl_iter;
   GPtrArray *arr;
+  guint i;
 
-  g_return_val_if_fail (bname != NULL, NULL);
-
-  buddies = purple_find_buddies (self->priv->conn->account, bname);
-
-  arr = g_ptr_array_sized_new (g_slist_length (buddies));
+  arr = g_ptr_array_sized_new (g_slist_length (buddies) + 1);
 
   for (sl_iter = buddies; sl_iter != NULL; sl_iter = sl_iter->next)
     {
@@ -880,7 +2232,18 @@ haze_contact_list_dup_contact_groups (TpBaseContactList *cl,
       g_ptr_array_add (arr, g_strdup (purple_group_get_name (group)));
     }
 
-  g_slist_free (buddies);
+  /* Groups it was in on the last roster, which it hasn't reappeared in
+   * yet */
+  for (i = 0; provisional != NULL && provisional[i] != NULL; i++)
+    {
+      TpHandleSet *members = g_hash_table_lookup (self->priv->groups,
+          provisional[i]);
+
+      if (members != NULL && tp_handle_set_is_member (members, contact) &&
+          !buddies_in_group (buddies, provisional[i]))
+        g_ptr_array_add (arr, g_strdup (provisional[i]));
+    }
+
   g_ptr_array_add (arr, NULL);
   return (GStrv) g_ptr_array_free (arr, FALSE);
 }
@@ -893,49 +2256,15 @@ haze_contact_list_dup_group_members (TpBaseContactList *cl,
   TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
   TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base_conn,
       TP_HANDLE_TYPE_CONTACT);
-  PurpleGroup *group = purple_find_group (group_name);
-  PurpleBlistNode *contact, *buddy;
-  TpHandleSet *members = tp_handle_set_new (contact_repo);
-
-  if (group == NULL)
-    return members;
-
-  for (contact = purple_blist_node_get_first_child ((PurpleBlistNode *) group);
-      contact != NULL;
-      contact = purple_blist_node_get_sibling_next (contact))
-    {
-      if (G_UNLIKELY (purple_blist_node_get_type (contact) !=
-            PURPLE_BLIST_CONTACT_NODE))
-        {
-          g_warning ("a child of a Group had unexpected type %d",
-              purple_blist_node_get_type (contact));
-          continue;
-        }
-
-      for (buddy = purple_blist_node_get_first_child (contact);
-          buddy != NULL;
-          buddy = purple_blist_node_get_sibling_next (buddy))
-        {
-          const gchar *bname;
-          TpHandle handle;
+  TpHandleSet *members;
 
-          if (G_UNLIKELY (purple_blist_node_get_type (buddy) !=
-                PURPLE_BLIST_BUDDY_NODE))
-            {
-              g_warning ("a child of a Contact had unexpected type %d",
-                  purple_blist_node_get_type (buddy));
-              continue;
-            }
+  ensure_buddy_index (self);
+  members = g_hash_table_lookup (self->priv->groups, group_name);
 
-          bname = purple_buddy_get_name (PURPLE_BUDDY (buddy));
-          handle = tp_handle_ensure (contact_repo, bname, NULL, NULL);
-
-          if (G_LIKELY (handle != 0))
-            tp_handle_set_add (members, handle);
-        }
-    }
+  if (members == NULL)
+    return tp_handle_set_new (contact_repo);
 
-  return members;
+  return tp_handle_set_copy (members);
 }
 
 static gchar *
@@ -991,12 +2320,12 @@ haze_contact_list_set_contact_groups_async (TpBaseContactList *cl,
     gpointer user_data)
 {
   HazeContactList *self = HAZE_CONTACT_LIST (cl);
-  PurpleAccount *account = self->priv->conn->account;
   const gchar *fallback_group;
   const gchar *bname = haze_connection_handle_inspect (self->priv->conn,
       TP_HANDLE_TYPE_CONTACT, contact);
   gsize i;
-  GSList *buddies, *l;
+  GList *unwanted = NULL;
+  GSList *l;
 
   g_assert (bname != NULL);
 
@@ -1008,14 +2337,14 @@ haze_contact_list_set_contact_groups_async (TpBaseContactList *cl,
       n_names = 1;
     }
 
+  batch_begin (self);
+
   /* put them in any groups they ought to be in */
   for (i = 0; i < n_names; i++)
     haze_contact_list_add_to_group (self, names[i], contact);
 
   /* remove them from any groups they ought to not be in */
-  buddies = purple_find_buddies (account, bname);
-
-  for (l = buddies; l != NULL; l = l->next)
+  for (l = peek_buddies (self, contact); l != NULL; l = l->next)
     {
       PurpleGroup *group = purple_buddy_get_group (l->data);
       const gchar *group_name = purple_group_get_name (group);
@@ -1031,12 +2360,13 @@ haze_contact_list_set_contact_groups_async (TpBaseContactList *cl,
         }
 
       if (!desired)
-        {
-          purple_account_remove_buddy (account, l->data, group);
-          purple_blist_remove_buddy (l->data);
-        }
+        unwanted = g_list_prepend (unwanted, l->data);
     }
 
+  remove_buddies (self, unwanted);
+  g_list_free (unwanted);
+  batch_end (self);
+
   tp_simple_async_report_success_in_idle ((GObject *) self, callback,
       user_data, haze_contact_list_set_contact_groups_async);
 }
@@ -1049,21 +2379,12 @@ haze_contact_list_add_to_group_async (TpBaseContactList *cl,
     gpointer user_data)
 {
   HazeContactList *self = HAZE_CONTACT_LIST (cl);
-  TpIntsetFastIter iter;
-  TpHandle handle;
-  /* This actually has "ensure" semantics, and doesn't return a ref */
-  PurpleGroup *group = purple_group_new (group_name);
+  PurpleGroup *group = ensure_group (self, group_name);
 
-  /* We have to reassure the TpBaseContactList that the group exists,
-   * because libpurple doesn't have a group-added signal */
   g_assert (group != NULL);
-  tp_base_contact_list_groups_created ((TpBaseContactList *) self,
-      &group_name, 1);
-
-  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (contacts));
 
-  while (tp_intset_fast_iter_next (&iter, &handle))
-    haze_contact_list_add_to_group (self, group_name, handle);
+  /* FIXME: This causes them to be added to 'subscribed' too. */
+  add_buddies (self, contacts, group);
 
   tp_simple_async_report_success_in_idle ((GObject *) self, callback,
       user_data, haze_contact_list_add_to_group_async);
@@ -1079,10 +2400,8 @@ haze_contact_list_remove_from_group_async (TpBaseContactList *cl,
   HazeContactList *self = HAZE_CONTACT_LIST (cl);
   GError *error = NULL;
 
-  if (haze_contact_list_prep_remove_from_group (self, group_name, contacts,
-        &error))
+  if (remove_from_group (self, group_name, contacts, &error))
     {
-      haze_contact_list_remove_many_from_group (self, group_name, contacts);
       tp_simple_async_report_success_in_idle ((GObject *) cl, callback,
           user_data, haze_contact_list_remove_from_group_async);
     }
@@ -1103,15 +2422,20 @@ haze_contact_list_remove_group_async (TpBaseContactList *cl,
   TpHandleSet *members = haze_contact_list_dup_group_members (cl, group_name);
   GError *error = NULL;
 
-  if (haze_contact_list_prep_remove_from_group (HAZE_CONTACT_LIST (cl),
-        group_name, members, &error))
+  if (remove_from_group (HAZE_CONTACT_LIST (cl), group_name, members,
+        &error))
     {
       PurpleGroup *group = purple_find_group (group_name);
 
+      /* libpurple won't remove the group if another account's buddies are
+       * still in it. */
       if (group != NULL)
         purple_blist_remove_group (group);
 
-      tp_base_contact_list_groups_removed (cl, &group_name, 1);
+      /* If removing its members emptied it, it's already gone */
+      if (g_hash_table_remove (HAZE_CONTACT_LIST (cl)->priv->groups,
+            group_name))
+        tp_base_contact_list_groups_removed (cl, &group_name, 1);
 
       tp_simple_async_report_success_in_idle ((GObject *) cl, callback,
           user_data, haze_contact_list_remove_group_async);
@@ -1136,26 +2460,21 @@ haze_contact_list_set_group_members_async (TpBaseContactList *cl,
   HazeContactList *self = HAZE_CONTACT_LIST (cl);
   TpHandleSet *outcasts = haze_contact_list_dup_group_members (cl, group_name);
   GError *error = NULL;
-  /* This actually has "ensure" semantics, and doesn't return a ref.
-   * We do this even if there are no contacts, to create the group as a
-   * side-effect. */
-  PurpleGroup *group = purple_group_new (group_name);
 
-  /* We have to reassure the TpBaseContactList that the group exists,
-   * because libpurple doesn't have a group-added signal */
-  g_assert (group != NULL);
-  tp_base_contact_list_groups_created ((TpBaseContactList *) self,
-      &group_name, 1);
+  /* We do this even if there are no contacts, to create the group as a
+   * side-effect. */
+  ensure_group (self, group_name);
 
   tp_intset_destroy (tp_handle_set_difference_update (outcasts,
         tp_handle_set_peek (contacts)));
 
-  if (haze_contact_list_prep_remove_from_group (HAZE_CONTACT_LIST (cl),
-        group_name, outcasts, &error))
+  /* Signal the removals and additions together */
+  batch_begin (self);
+
+  if (remove_from_group (self, group_name, outcasts, &error))
     {
       haze_contact_list_add_to_group_async (cl, group_name, contacts, callback,
           user_data);
-      haze_contact_list_remove_many_from_group (self, group_name, outcasts);
     }
   else
     {
@@ -1163,6 +2482,39 @@ haze_contact_list_set_group_members_async (TpBaseContactList *cl,
           user_data, error);
       g_clear_error (&error);
     }
+
+  batch_end (self);
+  tp_handle_set_destroy (outcasts);
+}
+
+static void
+group_index_rename (HazeContactList *self,
+    const gchar *old_name,
+    const gchar *new_name)
+{
+  gpointer old_key, members;
+
+  ensure_buddy_index (self);
+  /* Renaming announces that the old name is gone */
+  g_hash_table_remove (self->priv->emptied_groups, old_name);
+
+  if (g_hash_table_lookup_extended (self->priv->groups, old_name, &old_key,
+        &members))
+    {
+      g_hash_table_steal (self->priv->groups, old_name);
+      g_free (old_key);
+    }
+  else
+    {
+      members = NULL;
+    }
+
+  g_hash_table_remove (self->priv->groups, new_name);
+
+  if (members != NULL)
+    g_hash_table_insert (self->priv->groups, g_strdup (new_name), members);
+  else
+    group_index_ensure (self, new_name);
 }
 
 static void
@@ -1192,6 +2544,8 @@ haze_contact_list_rename_group_async (TpBaseContactList *cl,
     }
 
   purple_blist_rename_group (group, new_name);
+  group_index_rename (HAZE_CONTACT_LIST (cl), old_name,
+      purple_group_get_name (group));
   tp_base_contact_list_group_renamed (cl, old_name, new_name);
 
   tp_simple_async_report_success_in_idle ((GObject *) cl, callback,
@@ -1213,25 +2567,40 @@ haze_contact_list_mutable_groups_init (
   /* assume default: groups are stored persistently */
 }
 
+/* The deny list may have been loaded before the connection existed, so
+ * the set of blocked contacts is built from it the first time it's needed,
+ * and kept up to date by the privacy UI ops after that. */
 static TpHandleSet *
-dup_blocked_contacts (TpBaseContactList *cl)
+ensure_blocked (HazeContactList *self)
 {
-  HazeContactList *self = HAZE_CONTACT_LIST (cl);
-  PurpleAccount *account = self->priv->conn->account;
-  TpBaseConnection *base_conn = TP_BASE_CONNECTION (self->priv->conn);
-  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base_conn,
-      TP_HANDLE_TYPE_CONTACT);
-  TpHandleSet *blocked = tp_handle_set_new (contact_repo);
+  HazeContactListPrivate *priv = self->priv;
+  TpBaseConnection *base_conn = TP_BASE_CONNECTION (priv->conn);
+  TpHandleRepoIface *contact_repo;
   GSList *l;
 
-  for (l = account->deny; l != NULL; l = l->next) {
+  if (priv->blocked != NULL)
+    return priv->blocked;
+
+  contact_repo = tp_base_connection_get_handles (base_conn,
+      TP_HANDLE_TYPE_CONTACT);
+  priv->blocked = tp_handle_set_new (contact_repo);
+
+  for (l = priv->conn->account->deny; l != NULL; l = l->next) {
     TpHandle handle = tp_handle_ensure (contact_repo, l->data, NULL, NULL);
 
     if (G_LIKELY (handle != 0))
-      tp_handle_set_add (blocked, handle);
+      tp_handle_set_add (priv->blocked, handle);
   }
 
-  return blocked;
+  return priv->blocked;
+}
+
+static TpHandleSet *
+dup_blocked_contacts (TpBaseContactList *cl)
+{
+  HazeContactList *self = HAZE_CONTACT_LIST (cl);
+
+  return tp_handle_set_copy (ensure_blocked (self));
 }
 
 static void
@@ -1244,8 +2613,11 @@ set_contacts_privacy (TpBaseContactList *cl,
   TpIntsetFastIter iter;
   TpHandle handle;
 
+  /* Signal the changes together */
+  batch_begin (self);
   tp_intset_fast_iter_init (&iter, tp_handle_set_peek (contacts));
 
+  /* libpurple has no way to change the privacy lists in bulk */
   while (tp_intset_fast_iter_next (&iter, &handle))
     {
       const gchar *bname = haze_connection_handle_inspect (self->priv->conn,
@@ -1256,6 +2628,8 @@ set_contacts_privacy (TpBaseContactList *cl,
       else
         purple_privacy_allow (account, bname, FALSE, FALSE);
     }
+
+  batch_end (self);
 }
 
 static void
@@ -1302,18 +2676,32 @@ haze_contact_list_blockable_init(
   vtable->can_block = can_block;
 }
 
+/* Updates whether @name is blocked. If the blocked set hasn't been built
+ * yet, it will reflect the change when it is, but the change is still
+ * signalled. */
 static void
-haze_contact_list_deny_changed (
-    PurpleAccount *account,
-    const char *name)
+set_blocked (PurpleAccount *account,
+    const char *name,
+    gboolean blocked)
 {
-  HazeConnection *conn = ACCOUNT_GET_HAZE_CONNECTION (account);
-  TpBaseConnection *base_conn = TP_BASE_CONNECTION (conn);
-  TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base_conn,
-      TP_HANDLE_TYPE_CONTACT);
+  HazeConnection *conn;
+  HazeContactList *self;
+  TpBaseConnection *base_conn;
+  TpHandleRepoIface *contact_repo;
   GError *error = NULL;
-  TpHandle handle = tp_handle_ensure (contact_repo, name, NULL, &error);
-  TpHandleSet *set;
+  TpHandle handle;
+
+  /* Loading a persistent buddy list fills in the privacy lists of accounts
+   * with no connection yet. */
+  if (account->ui_data == NULL)
+    return;
+
+  conn = ACCOUNT_GET_HAZE_CONNECTION (account);
+  self = conn->contact_list;
+  base_conn = TP_BASE_CONNECTION (conn);
+  contact_repo = tp_base_connection_get_handles (base_conn,
+      TP_HANDLE_TYPE_CONTACT);
+  handle = tp_handle_ensure (contact_repo, name, NULL, &error);
 
   if (handle == 0)
     {
@@ -1322,19 +2710,78 @@ haze_contact_list_deny_changed (
       return;
     }
 
-  set = tp_handle_set_new_containing (contact_repo, handle);
-  tp_base_contact_list_contact_blocking_changed (
-      TP_BASE_CONTACT_LIST (conn->contact_list),
-      set);
-  g_object_unref (set);
+  if (self->priv->blocked != NULL)
+    {
+      if (blocked == tp_handle_set_is_member (self->priv->blocked, handle))
+        return;
+
+      if (blocked)
+        tp_handle_set_add (self->priv->blocked, handle);
+      else
+        tp_handle_set_remove (self->priv->blocked, handle);
+    }
+
+  /* When a server sends the whole deny list at once, this is signalled as
+   * one change. */
+  queue_blocking_changed (self, handle);
+}
+
+static void
+haze_contact_list_deny_added (
+    PurpleAccount *account,
+    const char *name)
+{
+  set_blocked (account, name, TRUE);
+}
+
+static void
+haze_contact_list_deny_removed (
+    PurpleAccount *account,
+    const char *name)
+{
+  set_blocked (account, name, FALSE);
+}
+
+/* Being added to or removed from the permit list doesn't change whether
+ * someone is on the deny list, as far as libpurple is concerned; but prpls
+ * are free to edit the deny list behind our backs when it changes, so check
+ * it rather than trusting what we've been told about it. */
+static void
+haze_contact_list_permit_changed (
+    PurpleAccount *account,
+    const char *name)
+{
+  gchar *normalized;
+  gboolean denied = FALSE;
+  GSList *l;
+
+  /* If we haven't looked at the deny list yet, there's nothing to check. */
+  if (account->ui_data == NULL ||
+      ACCOUNT_GET_HAZE_CONNECTION (account)->contact_list->priv->blocked ==
+          NULL)
+    return;
+
+  normalized = g_strdup (purple_normalize (account, name));
+
+  for (l = account->deny; l != NULL; l = l->next)
+    {
+      if (!tp_strdiff (normalized, purple_normalize (account, l->data)))
+        {
+          denied = TRUE;
+          break;
+        }
+    }
+
+  g_free (normalized);
+  set_blocked (account, name, denied);
 }
 
 static PurplePrivacyUiOps privacy_ui_ops =
 {
-  /* .permit_added = */ NULL,
-  /* .permit_removed = */ NULL,
-  /* .deny_added = */ haze_contact_list_deny_changed,
-  /* .deny_removed = */ haze_contact_list_deny_changed
+  /* .permit_added = */ haze_contact_list_permit_changed,
+  /* .permit_removed = */ haze_contact_list_permit_changed,
+  /* .deny_added = */ haze_contact_list_deny_added,
+  /* .deny_removed = */ haze_contact_list_deny_removed
 };
 
 PurplePrivacyUiOps *
@@ -1342,3 +2789,120 @@ haze_get_privacy_ui_ops (void)
 {
   return &privacy_ui_ops;
 }
+
+static void
+add_contact_states (HazeContactList *self,
+    GHashTable *changes,
+    TpHandle handle)
+{
+  TpSubscriptionState subscribe, publish;
+  gchar *publish_request;
+
+  haze_contact_list_dup_states ((TpBaseContactList *) self, handle,
+      &subscribe, &publish, &publish_request);
+
+  g_hash_table_insert (changes, GUINT_TO_POINTER (handle),
+      tp_value_array_build (3,
+          G_TYPE_UINT, subscribe,
+          G_TYPE_UINT, publish,
+          G_TYPE_STRING, publish_request != NULL ? publish_request : "",
+          G_TYPE_INVALID));
+
+  g_free (publish_request);
+}
+
+static void
+haze_contact_list_get_contact_list_changes (
+    HazeSvcConnectionInterfaceContactListChanges *iface,
+    guint64 since,
+    DBusGMethodInvocation *context)
+{
+  HazeConnection *conn = HAZE_CONNECTION (iface);
+  TpBaseConnection *base = TP_BASE_CONNECTION (conn);
+  HazeContactList *self;
+  HazeContactListPrivate *priv;
+  GHashTable *changes;
+  GArray *removed;
+  gboolean complete;
+  TpHandleSet *contacts;
+  TpIntsetFastIter iter;
+  TpHandle handle;
+
+  TP_BASE_CONNECTION_ERROR_IF_NOT_CONNECTED (base, context);
+
+  self = conn->contact_list;
+  priv = self->priv;
+
+  if (priv->version == 0)
+    {
+      GError e = { TP_ERROR, TP_ERROR_NOT_YET,
+          "The contact list has not been retrieved yet" };
+
+      dbus_g_method_return_error (context, &e);
+      return;
+    }
+
+  /* Make sure the client has been told about everything in the reply */
+  if (priv->batch_depth == 0)
+    haze_contact_list_flush (self);
+
+  changes = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) g_value_array_free);
+  removed = g_array_new (FALSE, FALSE, sizeof (guint));
+  complete = (since < priv->log_floor || since > priv->version);
+
+  if (complete)
+    {
+      contacts = haze_contact_list_dup_contacts ((TpBaseContactList *) self);
+    }
+  else
+    {
+      TpHandleRepoIface *contact_repo = tp_base_connection_get_handles (base,
+          TP_HANDLE_TYPE_CONTACT);
+      guint i;
+
+      contacts = tp_handle_set_new (contact_repo);
+
+      /* The log is in version order */
+      for (i = priv->change_log->len; i > 0; i--)
+        {
+          ChangeLogEntry *entry = &g_array_index (priv->change_log,
+              ChangeLogEntry, i - 1);
+
+          if (entry->version <= since)
+            break;
+
+          tp_handle_set_add (contacts, entry->handle);
+        }
+    }
+
+  tp_intset_fast_iter_init (&iter, tp_handle_set_peek (contacts));
+
+  while (tp_intset_fast_iter_next (&iter, &handle))
+    {
+      if (complete || is_on_list (self, handle))
+        add_contact_states (self, changes, handle);
+      else
+        g_array_append_val (removed, handle);
+    }
+
+  haze_svc_connection_interface_contact_list_changes_return_from_get_contact_list_changes (
+      context, priv->version, complete, changes, removed);
+
+  tp_handle_set_destroy (contacts);
+  g_hash_table_unref (changes);
+  g_array_free (removed, TRUE);
+}
+
+void
+haze_contact_list_changes_iface_init (gpointer g_iface,
+    gpointer iface_data)
+{
+  HazeSvcConnectionInterfaceContactListChangesClass *klass = g_iface;
+
+#define IMPLEMENT(x) \
+  haze_svc_connection_interface_contact_list_changes_implement_##x (\
+      klass, haze_contact_list_##x)
+  IMPLEMENT (get_contact_list_changes);
+#undef IMPLEMENT
+}
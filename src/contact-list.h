@@ -67,6 +67,13 @@ gpointer haze_request_authorize (PurpleAccount *account,
     PurpleAccountRequestAuthorizationCb deny_cb, void *user_data);
 void haze_close_account_request (gpointer request_data_);
 
+void haze_contact_list_set_list_received (HazeContactList *self);
+
+void haze_contact_list_forget_rosters (void);
+
+void haze_contact_list_buddy_renamed (HazeContactList *self,
+    PurpleBuddy *buddy, TpHandle old_handle, TpHandle new_handle);
+
 void haze_contact_list_accept_publish_request (HazeContactList *self,
     TpHandle handle);
 void haze_contact_list_reject_publish_request (HazeContactList *self,
@@ -84,4 +91,7 @@ gboolean haze_contact_list_remove_from_group (HazeContactList *self,
 
 PurplePrivacyUiOps *haze_get_privacy_ui_ops (void);
 
+void haze_contact_list_changes_iface_init (gpointer g_iface,
+    gpointer iface_data);
+
 #endif /* #ifndef __HAZE_CONTACT_LIST_H__*/
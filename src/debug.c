@@ -22,10 +22,16 @@
 
 #include <string.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <libpurple/debug.h>
 #include <telepathy-glib/debug.h>
 #include <telepathy-glib/debug-sender.h>
+#include <telepathy-glib/util.h>
+
+#include "trace.h"
 
 
 typedef enum
@@ -44,21 +50,272 @@ static GDebugKey keys[] =
 
 static HazeDebugFlags flags = 0;
 
+/* Formatting debug messages is not free, and some are logged once per
+ * contact, so they are only formatted if HAZE_DEBUG or HAZE_PERSIST is set,
+ * a client is monitoring the Debug interface, or the ring buffer is on.
+ */
+gboolean haze_debug_active = FALSE;
+
+static gboolean debug_env_set = FALSE;
+static TpDebugSender *debug_sender = NULL;
+static gulong debug_sender_enabled_id = 0;
+static gboolean monitored = FALSE;
+
+/*** Ring buffer ***/
+
+/* If HAZE_DEBUG_RING is set to a number of messages, that many of the most
+ * recent messages are kept in a preallocated ring buffer while nobody is
+ * monitoring the Debug interface, instead of being handed one by one to the
+ * debug sender.  Logging a message then only costs formatting it into its
+ * record.  The records are handed to the debug sender when a client starts
+ * monitoring, and written to stderr if haze crashes.
+ */
+#define RING_TEXT_SIZE 240
+#define RING_CATEGORY_SIZE 32
+
+typedef struct _HazeDebugRecord HazeDebugRecord;
+struct _HazeDebugRecord {
+    /* Wall-clock time, in microseconds */
+    gint64 timestamp;
+    /* libpurple's debug category, or "" for haze's own messages. This is
+     * copied rather than interned, so that the crash handler can write it
+     * without taking GLib's quark lock. */
+    gchar category[RING_CATEGORY_SIZE];
+    GLogLevelFlags level;
+    gchar text[RING_TEXT_SIZE];
+};
+
+static HazeDebugRecord *ring = NULL;
+static guint ring_size = 0;
+/* The index of the oldest record, and the number of records in use */
+static guint ring_start = 0;
+static guint ring_len = 0;
+
+static HazeDebugRecord *
+ring_append (const gchar *category,
+             GLogLevelFlags level)
+{
+    HazeDebugRecord *record;
+
+    if (ring_len < ring_size)
+    {
+        record = ring + (ring_start + ring_len) % ring_size;
+        ring_len++;
+    }
+    else
+    {
+        /* Overwrite the oldest record */
+        record = ring + ring_start;
+        ring_start = (ring_start + 1) % ring_size;
+    }
+
+    record->timestamp = g_get_real_time ();
+    g_strlcpy (record->category, category != NULL ? category : "",
+        sizeof (record->category));
+    record->level = level;
+
+    return record;
+}
+
+static void
+ring_format_domain (const HazeDebugRecord *record,
+                    gchar *buf,
+                    gsize size)
+{
+    if (record->category[0] == '\0')
+        g_strlcpy (buf, G_LOG_DOMAIN "/haze", size);
+    else
+        g_snprintf (buf, size, "purple/%s", record->category);
+}
+
+static void
+ring_flush_to_sender (TpDebugSender *sender)
+{
+    guint i;
+
+    for (i = 0; i < ring_len; i++)
+    {
+        const HazeDebugRecord *record = ring + (ring_start + i) % ring_size;
+        gchar domain[64];
+        GTimeVal when;
+
+        ring_format_domain (record, domain, sizeof (domain));
+        when.tv_sec = record->timestamp / G_USEC_PER_SEC;
+        when.tv_usec = record->timestamp % G_USEC_PER_SEC;
+
+        tp_debug_sender_add_message (sender, &when, domain, record->level,
+            record->text);
+    }
+
+    ring_start = 0;
+    ring_len = 0;
+}
+
+/* Only async-signal-safe functions may be used from here on. */
+
+static void
+crash_write (const gchar *s)
+{
+    gsize len = strlen (s);
+
+    while (len > 0)
+    {
+        ssize_t written = write (STDERR_FILENO, s, len);
+
+        if (written <= 0)
+            return;
+
+        s += written;
+        len -= written;
+    }
+}
+
+static void
+crash_write_uint (guint64 n,
+                  guint min_digits)
+{
+    gchar buf[21];
+    gchar *p = buf + sizeof (buf) - 1;
+
+    *p = '\0';
+
+    do
+    {
+        *--p = '0' + (n % 10);
+        n /= 10;
+    }
+    while ((n > 0 || buf + sizeof (buf) - 1 - p < min_digits) && p > buf);
+
+    crash_write (p);
+}
+
+static void
+crash_handler (int sig)
+{
+    guint i;
+
+    crash_write ("telepathy-haze crashed; most recent debug messages:\n");
+
+    for (i = 0; i < ring_len; i++)
+    {
+        const HazeDebugRecord *record = ring + (ring_start + i) % ring_size;
+
+        crash_write_uint (record->timestamp / G_USEC_PER_SEC, 1);
+        crash_write (".");
+        crash_write_uint (record->timestamp % G_USEC_PER_SEC, 6);
+        crash_write (record->category[0] == '\0' ? " haze: " : " purple/");
+
+        if (record->category[0] != '\0')
+        {
+            crash_write (record->category);
+            crash_write (": ");
+        }
+
+        crash_write (record->text);
+        crash_write ("\n");
+    }
+
+    /* The handler was installed with SA_RESETHAND, so this is fatal. */
+    raise (sig);
+}
+
+static void
+ring_init (const gchar *size)
+{
+    static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE,
+        SIGABRT };
+    struct sigaction sa;
+    guint i;
+
+    ring_size = strtoul (size, NULL, 10);
+
+    if (ring_size == 0)
+        return;
+
+    ring = g_new0 (HazeDebugRecord, ring_size);
+
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = crash_handler;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset (&sa.sa_mask);
+
+    for (i = 0; i < G_N_ELEMENTS (crash_signals); i++)
+        sigaction (crash_signals[i], &sa, NULL);
+}
+
+/*** End of ring buffer ***/
+
+static void
+update_active (void)
+{
+    monitored = FALSE;
+
+    if (debug_sender != NULL)
+        g_object_get (debug_sender, "enabled", &monitored, NULL);
+
+    haze_debug_active = (debug_env_set || monitored || ring != NULL);
+}
+
+static void
+debug_sender_enabled_cb (GObject *sender,
+                         GParamSpec *pspec,
+                         gpointer unused)
+{
+    update_active ();
+
+    if (monitored && ring != NULL)
+        ring_flush_to_sender (debug_sender);
+}
+
+/**
+ * haze_debug_set_sender:
+ * @sender: the connection manager's debug sender, or %NULL when it is
+ *          about to be released
+ *
+ * Starts or stops formatting debug messages whenever a client enables or
+ * disables monitoring on @sender.
+ */
+void
+haze_debug_set_sender (TpDebugSender *sender)
+{
+    if (debug_sender != NULL)
+        g_signal_handler_disconnect (debug_sender, debug_sender_enabled_id);
+
+    debug_sender = sender;
+    debug_sender_enabled_id = 0;
+
+    if (debug_sender != NULL)
+        debug_sender_enabled_id = g_signal_connect (debug_sender,
+            "notify::enabled", G_CALLBACK (debug_sender_enabled_cb), NULL);
+
+    update_active ();
+}
+
 
 void
 haze_debug_set_flags_from_env ()
 {
     const gchar *env = g_getenv ("HAZE_DEBUG");
+    const gchar *ring_env = g_getenv ("HAZE_DEBUG_RING");
+
+    if (ring_env != NULL)
+        ring_init (ring_env);
 
     if (env)
     {
        flags |= g_parse_debug_string (env, keys, 2);
+       debug_env_set = TRUE;
     }
 
     tp_debug_set_flags (env);
 
     if (g_getenv ("HAZE_PERSIST"))
+    {
         tp_debug_set_persistent (TRUE);
+        debug_env_set = TRUE;
+    }
+
+    update_active ();
 
     tp_debug_divert_messages (g_getenv ("HAZE_LOGFILE"));
 }
@@ -96,10 +353,35 @@ haze_debug_print (PurpleDebugLevel level,
                   const char *category,
                   const char *arg_s)
 {
-    gchar *argh = g_strchomp (g_strdup (arg_s));
-    gchar *domain = g_strdup_printf ("purple/%s", category);
+    gchar *argh;
+    gchar *domain;
     GLogLevelFlags log_level = debug_level_map[level];
 
+    /* This is the only way to find out when libpurple probes each plugin. */
+    if (haze_trace_is_enabled () && !tp_strdiff (category, "plugins") &&
+        g_str_has_prefix (arg_s, "probing "))
+    {
+        argh = g_strchomp (g_strdup (arg_s + strlen ("probing ")));
+        haze_trace_probe (argh);
+        g_free (argh);
+    }
+
+    if (!haze_debug_active && !(flags & HAZE_DEBUG_PURPLE))
+        return;
+
+    if (ring != NULL && !monitored && !(flags & HAZE_DEBUG_PURPLE))
+    {
+        HazeDebugRecord *record = ring_append (category,
+            log_level);
+
+        g_strlcpy (record->text, arg_s, sizeof (record->text));
+        g_strchomp (record->text);
+        return;
+    }
+
+    argh = g_strchomp (g_strdup (arg_s));
+    domain = g_strdup_printf ("purple/%s", category);
+
     /* The default log handler catches g_log. Calling log_to_debug_sender
      * and g_log duplicates debug messages */
     if (flags & HAZE_DEBUG_PURPLE)
@@ -111,10 +393,19 @@ haze_debug_print (PurpleDebugLevel level,
     g_free(argh);
 }
 
+static gboolean
+haze_debug_is_enabled (PurpleDebugLevel level,
+                       const char *category)
+{
+    /* Startup tracing relies on libpurple's plugin probing messages. */
+    return (haze_debug_active || (flags & HAZE_DEBUG_PURPLE) ||
+        (haze_trace_is_enabled () && !tp_strdiff (category, "plugins")));
+}
+
 static PurpleDebugUiOps haze_debug_uiops =
 {
     haze_debug_print,
-    NULL,
+    haze_debug_is_enabled,
     /* padding */
     NULL,
     NULL,
@@ -140,6 +431,20 @@ haze_debug (const gchar *format,
     gchar *message;
     va_list args;
 
+    if (ring != NULL && !monitored)
+    {
+        HazeDebugRecord *record = ring_append (NULL, G_LOG_LEVEL_DEBUG);
+
+        va_start (args, format);
+        g_vsnprintf (record->text, sizeof (record->text), format, args);
+        va_end (args);
+
+        if (flags & HAZE_DEBUG_HAZE)
+            g_log (G_LOG_DOMAIN, G_LOG_LEVEL_DEBUG, "%s", record->text);
+
+        return;
+    }
+
     va_start (args, format);
     message = g_strdup_vprintf (format, args);
     va_end (args);
@@ -20,6 +20,11 @@
 
 #include <glib.h>
 
+#include <telepathy-glib/debug-sender.h>
+
+/* TRUE if anyone might read debug messages; see debug.c */
+extern gboolean haze_debug_active;
+
 void haze_debug_init(void);
 
 void haze_debug (const gchar *format, ...)
@@ -29,5 +34,10 @@ void haze_debug_free (void);
 
 void haze_debug_set_flags_from_env (void);
 
+void haze_debug_set_sender (TpDebugSender *sender);
+
 #define DEBUG(format, ...) \
-    haze_debug ("%s: " format, G_STRFUNC, ##__VA_ARGS__)
+    G_STMT_START { \
+        if (G_UNLIKELY (haze_debug_active)) \
+            haze_debug ("%s: " format, G_STRFUNC, ##__VA_ARGS__); \
+    } G_STMT_END
@@ -0,0 +1,861 @@
+/*
+ * eventloop.c - haze's implementation of libpurple's event loop
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "config.h"
+
+#include "eventloop.h"
+
+#include <string.h>
+
+#include "debug.h"
+#include "watchdog.h"
+
+/* Copied verbatim from nullclient, modulo changing whitespace. */
+#define PURPLE_GLIB_READ_COND  (G_IO_IN | G_IO_HUP | G_IO_ERR)
+#define PURPLE_GLIB_WRITE_COND (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+/* Handles given to libpurple are the slot index + 1 in the low bits, with a
+ * per-slot generation count in the high bits so that a stale handle for a
+ * recycled slot is not mistaken for the watch which now lives there.
+ */
+#define SLOT_BITS 20
+#define SLOT_MASK ((1 << SLOT_BITS) - 1)
+#define MAX_SLOTS SLOT_MASK
+
+#define MAKE_HANDLE(slot, generation) \
+    ((((generation) << SLOT_BITS) & ~SLOT_MASK) | ((slot) + 1))
+#define HANDLE_GET_SLOT(handle) (((handle) & SLOT_MASK) - 1)
+
+/*** Input watches ***/
+
+/* libpurple re-arms some watches many times per second, so rather than
+ * creating a GIOChannel and a GSource per watch, every fd is polled by a
+ * single GSource.  Watch records are allocated once and then recycled via a
+ * free list, so adding and removing a watch does not touch the heap.
+ */
+typedef struct _HazeInputWatch HazeInputWatch;
+struct _HazeInputWatch {
+    GPollFD pollfd;
+    PurpleInputFunction function;
+    gpointer data;
+
+    /* The handle libpurple knows this watch by, or 0 if the slot is free */
+    guint handle;
+    guint generation;
+
+    /* If this slot is free, the index + 1 of the next free slot, or 0 */
+    guint next_free;
+};
+
+static GSource *input_source = NULL;
+/* Slot index => owned HazeInputWatch */
+static GPtrArray *input_watches = NULL;
+static guint input_free_list = 0;
+
+static gboolean
+input_source_prepare (GSource *source,
+                      gint *timeout)
+{
+    *timeout = -1;
+    return FALSE;
+}
+
+static gboolean
+input_source_check (GSource *source)
+{
+    guint i;
+
+    for (i = 0; i < input_watches->len; i++)
+    {
+        HazeInputWatch *watch = g_ptr_array_index (input_watches, i);
+
+        if (watch->handle != 0 &&
+            (watch->pollfd.revents & watch->pollfd.events) != 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean
+input_source_dispatch (GSource *source,
+                       GSourceFunc callback,
+                       gpointer user_data)
+{
+    guint i;
+
+    /* Callbacks may add and remove watches, including their own, so the
+     * table is re-read on every iteration rather than cached.
+     */
+    for (i = 0; i < input_watches->len; i++)
+    {
+        HazeInputWatch *watch = g_ptr_array_index (input_watches, i);
+        gushort condition = watch->pollfd.revents & watch->pollfd.events;
+        PurpleInputCondition purple_cond = 0;
+
+        if (watch->handle == 0 || condition == 0)
+            continue;
+
+        watch->pollfd.revents = 0;
+
+        if (condition & PURPLE_GLIB_READ_COND)
+            purple_cond |= PURPLE_INPUT_READ;
+        if (condition & PURPLE_GLIB_WRITE_COND)
+            purple_cond |= PURPLE_INPUT_WRITE;
+
+        haze_watchdog_begin ("input", watch->function, watch->pollfd.fd);
+        watch->function (watch->data, watch->pollfd.fd, purple_cond);
+        haze_watchdog_end ();
+    }
+
+    return TRUE;
+}
+
+static GSourceFuncs input_source_funcs = {
+    input_source_prepare,
+    input_source_check,
+    input_source_dispatch,
+    NULL
+};
+
+static HazeInputWatch *
+input_watch_alloc (void)
+{
+    HazeInputWatch *watch;
+    guint slot;
+
+    if (input_free_list != 0)
+    {
+        slot = input_free_list - 1;
+        watch = g_ptr_array_index (input_watches, slot);
+        input_free_list = watch->next_free;
+    }
+    else
+    {
+        slot = input_watches->len;
+        g_return_val_if_fail (slot < MAX_SLOTS, NULL);
+
+        watch = g_slice_new0 (HazeInputWatch);
+        g_ptr_array_add (input_watches, watch);
+    }
+
+    watch->generation++;
+    watch->handle = MAKE_HANDLE (slot, watch->generation);
+    watch->next_free = 0;
+
+    return watch;
+}
+
+static HazeInputWatch *
+input_watch_lookup (guint handle)
+{
+    guint slot = HANDLE_GET_SLOT (handle);
+    HazeInputWatch *watch;
+
+    if (input_watches == NULL || handle == 0 || slot >= input_watches->len)
+        return NULL;
+
+    watch = g_ptr_array_index (input_watches, slot);
+
+    if (watch->handle != handle)
+        return NULL;
+
+    return watch;
+}
+
+static guint
+haze_input_add (gint fd,
+                PurpleInputCondition condition,
+                PurpleInputFunction function,
+                gpointer data)
+{
+    HazeInputWatch *watch;
+    gushort events = 0;
+
+    if (input_source == NULL)
+    {
+        input_watches = g_ptr_array_new ();
+        input_source = g_source_new (&input_source_funcs, sizeof (GSource));
+        g_source_attach (input_source, NULL);
+    }
+
+    watch = input_watch_alloc ();
+    g_return_val_if_fail (watch != NULL, 0);
+
+    if (condition & PURPLE_INPUT_READ)
+        events |= PURPLE_GLIB_READ_COND;
+    if (condition & PURPLE_INPUT_WRITE)
+        events |= PURPLE_GLIB_WRITE_COND;
+
+    watch->pollfd.fd = fd;
+    watch->pollfd.events = events;
+    watch->pollfd.revents = 0;
+    watch->function = function;
+    watch->data = data;
+
+    g_source_add_poll (input_source, &watch->pollfd);
+
+    return watch->handle;
+}
+
+static gboolean
+haze_input_remove (guint handle)
+{
+    HazeInputWatch *watch = input_watch_lookup (handle);
+
+    if (watch == NULL)
+    {
+        DEBUG ("no such input watch %u", handle);
+        return FALSE;
+    }
+
+    g_source_remove_poll (input_source, &watch->pollfd);
+
+    watch->handle = 0;
+    watch->function = NULL;
+    watch->data = NULL;
+    watch->pollfd.revents = 0;
+    watch->next_free = input_free_list;
+    input_free_list = HANDLE_GET_SLOT (handle) + 1;
+
+    return TRUE;
+}
+
+/*** End of input watches ***/
+
+/*** Timers ***/
+
+/* Every libpurple timer lives in a hierarchical timing wheel driven by a
+ * single GSource, rather than being a GSource of its own.  Adding or removing
+ * a timer is O(1), and the source only wakes up for the earliest timer.
+ * Timers added with timeout_add_seconds are rounded up to a whole second, so
+ * that keepalives, reconnection and typing timers across all connections
+ * share wakeups.
+ *
+ * The wheel counts in milliseconds ("ticks").  Level 0 has one slot per tick
+ * for the current block of 256 ticks; each higher level has 64 slots, each
+ * covering a whole slot's worth of the level below.  A timer is filed in the
+ * lowest level whose span still contains both it and the current tick, and
+ * is moved down a level ("cascaded") when the current tick enters its slot.
+ */
+#define WHEEL_LEVELS 5
+#define WHEEL_L0_BITS 8
+#define WHEEL_LN_BITS 6
+#define WHEEL_L0_SIZE (1 << WHEEL_L0_BITS)
+#define WHEEL_LN_SIZE (1 << WHEEL_LN_BITS)
+#define WHEEL_SHIFT(level) (WHEEL_L0_BITS + ((level) - 1) * WHEEL_LN_BITS)
+
+/* Timers further in the future than this are filed here and re-filed when
+ * they come round, so that the top level never wraps onto its own slot.
+ */
+#define WHEEL_MAX_DELTA (G_GUINT64_CONSTANT (1) << 31)
+
+typedef struct _HazeTimer HazeTimer;
+struct _HazeTimer {
+    HazeTimer *prev;
+    HazeTimer *next;
+    /* The head of the list this timer is linked into, or NULL */
+    HazeTimer **list;
+
+    /* The tick at which this timer's slot comes round */
+    guint64 tick;
+    /* The tick at which this timer is really due */
+    guint64 expires;
+
+    /* In milliseconds */
+    guint64 interval;
+    gboolean seconds;
+    GSourceFunc function;
+    gpointer data;
+
+    /* TRUE while function is being called */
+    gboolean dispatching;
+
+    /* The handle libpurple knows this timer by, or 0 if the slot is free or
+     * the timer was removed during its own callback */
+    guint handle;
+    guint generation;
+    guint slot;
+
+    /* If this slot is free, the index + 1 of the next free slot, or 0 */
+    guint next_free;
+};
+
+static GSource *timer_source = NULL;
+/* Slot index => owned HazeTimer */
+static GPtrArray *timers = NULL;
+static guint timer_free_list = 0;
+
+static HazeTimer *wheel_level0[WHEEL_L0_SIZE];
+static HazeTimer *wheel_levels[WHEEL_LEVELS - 1][WHEEL_LN_SIZE];
+static HazeTimer *expired_timers = NULL;
+static guint n_wheel_timers = 0;
+/* The next tick to be processed; every earlier tick has been. */
+static guint64 current_tick = 0;
+
+/* A lower bound for the tick of every timer in the wheel, and exact if
+ * next_tick_valid is set.
+ */
+static guint64 next_tick = G_MAXUINT64;
+static gboolean next_tick_valid = TRUE;
+
+static guint64
+timer_now (void)
+{
+    return g_get_monotonic_time () / 1000;
+}
+
+/* Lists are kept in the order timers were linked into them, so that timers
+ * which fall due together are dispatched in the order they were added, as
+ * GLib would. The head's prev points to the tail, so appending is O(1);
+ * the tail's next is NULL.
+ */
+static void
+timer_link (HazeTimer *timer,
+            HazeTimer **list)
+{
+    HazeTimer *head = *list;
+
+    timer->list = list;
+    timer->next = NULL;
+
+    if (head == NULL)
+    {
+        timer->prev = timer;
+        *list = timer;
+    }
+    else
+    {
+        timer->prev = head->prev;
+        head->prev->next = timer;
+        head->prev = timer;
+    }
+}
+
+static void
+timer_unlink (HazeTimer *timer)
+{
+    HazeTimer *head;
+
+    if (timer->list == NULL)
+        return;
+
+    head = *timer->list;
+
+    if (timer == head)
+        *timer->list = timer->next;
+    else
+        timer->prev->next = timer->next;
+
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+    else if (timer != head)
+        head->prev = timer->prev;
+
+    timer->list = NULL;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+static void
+wheel_file (HazeTimer *timer)
+{
+    guint64 tick = timer->tick;
+    guint level;
+
+    if ((tick >> WHEEL_L0_BITS) == (current_tick >> WHEEL_L0_BITS))
+    {
+        timer_link (timer, &wheel_level0[tick & (WHEEL_L0_SIZE - 1)]);
+        return;
+    }
+
+    for (level = 1; level < WHEEL_LEVELS - 1; level++)
+    {
+        guint shift = WHEEL_SHIFT (level + 1);
+
+        if ((tick >> shift) == (current_tick >> shift))
+            break;
+    }
+
+    timer_link (timer, &wheel_levels[level - 1][
+        (tick >> WHEEL_SHIFT (level)) & (WHEEL_LN_SIZE - 1)]);
+}
+
+static void
+wheel_insert (HazeTimer *timer)
+{
+    timer->tick = CLAMP (timer->expires, current_tick,
+        current_tick + WHEEL_MAX_DELTA);
+
+    wheel_file (timer);
+    n_wheel_timers++;
+
+    if (timer->tick < next_tick)
+        next_tick = timer->tick;
+}
+
+static void
+wheel_remove (HazeTimer *timer)
+{
+    if (timer->list == NULL)
+        return;
+
+    if (timer->list != &expired_timers)
+    {
+        n_wheel_timers--;
+
+        if (timer->tick == next_tick)
+            next_tick_valid = FALSE;
+    }
+
+    timer_unlink (timer);
+}
+
+static void
+wheel_cascade (guint level,
+               guint slot)
+{
+    HazeTimer *list = wheel_levels[level - 1][slot];
+    HazeTimer *timer;
+
+    wheel_levels[level - 1][slot] = NULL;
+
+    while ((timer = list) != NULL)
+    {
+        list = timer->next;
+        timer->list = NULL;
+        wheel_file (timer);
+    }
+}
+
+/* Moves the current tick to @tick, which must be no later than any timer in
+ * the wheel, cascading any slots which the move brings into range.
+ */
+static void
+wheel_jump (guint64 tick)
+{
+    guint64 old_tick = current_tick;
+    guint level;
+
+    current_tick = tick;
+
+    for (level = WHEEL_LEVELS - 1; level > 0; level--)
+    {
+        guint shift = WHEEL_SHIFT (level);
+
+        if ((tick >> shift) != (old_tick >> shift))
+            wheel_cascade (level, (tick >> shift) & (WHEEL_LN_SIZE - 1));
+    }
+}
+
+static guint64
+wheel_list_min_tick (HazeTimer *list)
+{
+    guint64 min = G_MAXUINT64;
+
+    for (; list != NULL; list = list->next)
+        min = MIN (min, list->tick);
+
+    return min;
+}
+
+static guint64
+wheel_get_next_tick (void)
+{
+    guint level, i;
+
+    if (next_tick_valid)
+        return next_tick;
+
+    next_tick = G_MAXUINT64;
+    next_tick_valid = TRUE;
+
+    if (n_wheel_timers == 0)
+        return next_tick;
+
+    for (i = current_tick & (WHEEL_L0_SIZE - 1); i < WHEEL_L0_SIZE; i++)
+    {
+        if (wheel_level0[i] != NULL)
+        {
+            next_tick = (current_tick & ~(guint64) (WHEEL_L0_SIZE - 1)) | i;
+            return next_tick;
+        }
+    }
+
+    /* Slots behind the current one in each level are empty, so the first
+     * occupied slot ahead of it holds the earliest timers of that level, and
+     * anything in a higher level is later still.
+     */
+    for (level = 1; level < WHEEL_LEVELS; level++)
+    {
+        guint current = (current_tick >> WHEEL_SHIFT (level)) &
+            (WHEEL_LN_SIZE - 1);
+
+        for (i = 1; i < WHEEL_LN_SIZE; i++)
+        {
+            HazeTimer *list =
+                wheel_levels[level - 1][(current + i) & (WHEEL_LN_SIZE - 1)];
+
+            if (list != NULL)
+            {
+                next_tick = wheel_list_min_tick (list);
+                return next_tick;
+            }
+        }
+    }
+
+    g_assert_not_reached ();
+    return next_tick;
+}
+
+/* Moves every timer due at or before @now onto expired_timers. */
+static void
+wheel_advance (guint64 now)
+{
+    while (current_tick <= now)
+    {
+        guint64 next = wheel_get_next_tick ();
+        HazeTimer *timer;
+
+        if (next > now)
+        {
+            wheel_jump (now + 1);
+            break;
+        }
+
+        if (next > current_tick)
+            wheel_jump (next);
+
+        while ((timer = wheel_level0[current_tick & (WHEEL_L0_SIZE - 1)])
+            != NULL)
+        {
+            wheel_remove (timer);
+            timer_link (timer, &expired_timers);
+        }
+
+        wheel_jump (current_tick + 1);
+        next_tick_valid = FALSE;
+    }
+}
+
+static void
+timer_set_expiry (HazeTimer *timer,
+                  guint64 now)
+{
+    timer->expires = now + timer->interval;
+
+    /* Round up to a whole second, so that all the timers due in a given
+     * second fire together.
+     */
+    if (timer->seconds)
+        timer->expires = (timer->expires + 999) / 1000 * 1000;
+}
+
+static gboolean
+timer_source_prepare (GSource *source,
+                      gint *timeout)
+{
+    guint64 now = timer_now ();
+    guint64 next = wheel_get_next_tick ();
+
+    if (expired_timers != NULL || next <= now)
+    {
+        *timeout = 0;
+        return TRUE;
+    }
+
+    if (next == G_MAXUINT64 || next - now > G_MAXINT)
+        *timeout = -1;
+    else
+        *timeout = next - now;
+
+    return FALSE;
+}
+
+static gboolean
+timer_source_check (GSource *source)
+{
+    return (expired_timers != NULL || wheel_get_next_tick () <= timer_now ());
+}
+
+static void timer_release (HazeTimer *timer);
+
+static gboolean
+timer_source_dispatch (GSource *source,
+                       GSourceFunc callback,
+                       gpointer user_data)
+{
+    guint64 now = timer_now ();
+    HazeTimer *timer;
+
+    wheel_advance (now);
+
+    while ((timer = expired_timers) != NULL)
+    {
+        gboolean again;
+
+        timer_unlink (timer);
+
+        if (timer->expires > now)
+        {
+            /* This one was too far in the future to be filed precisely. */
+            wheel_insert (timer);
+            continue;
+        }
+
+        timer->dispatching = TRUE;
+        haze_watchdog_begin ("timeout", timer->function, -1);
+        again = timer->function (timer->data);
+        haze_watchdog_end ();
+        timer->dispatching = FALSE;
+
+        if (timer->handle == 0 || !again)
+        {
+            /* Either the callback removed its own timer, or it asked not to
+             * be called again.
+             */
+            timer_release (timer);
+        }
+        else
+        {
+            timer_set_expiry (timer, timer_now ());
+            wheel_insert (timer);
+        }
+    }
+
+    return TRUE;
+}
+
+static GSourceFuncs timer_source_funcs = {
+    timer_source_prepare,
+    timer_source_check,
+    timer_source_dispatch,
+    NULL
+};
+
+static HazeTimer *
+timer_alloc (void)
+{
+    HazeTimer *timer;
+    guint slot;
+
+    if (timer_free_list != 0)
+    {
+        slot = timer_free_list - 1;
+        timer = g_ptr_array_index (timers, slot);
+        timer_free_list = timer->next_free;
+    }
+    else
+    {
+        slot = timers->len;
+        g_return_val_if_fail (slot < MAX_SLOTS, NULL);
+
+        timer = g_slice_new0 (HazeTimer);
+        timer->slot = slot;
+        g_ptr_array_add (timers, timer);
+    }
+
+    timer->generation++;
+    timer->handle = MAKE_HANDLE (slot, timer->generation);
+    timer->next_free = 0;
+
+    return timer;
+}
+
+/* Returns @timer's slot to the free list; it must not be in any list. */
+static void
+timer_release (HazeTimer *timer)
+{
+    g_assert (timer->list == NULL);
+    g_assert (!timer->dispatching);
+
+    timer->handle = 0;
+    timer->function = NULL;
+    timer->data = NULL;
+    timer->next_free = timer_free_list;
+    timer_free_list = timer->slot + 1;
+}
+
+static HazeTimer *
+timer_lookup (guint handle)
+{
+    guint slot = HANDLE_GET_SLOT (handle);
+    HazeTimer *timer;
+
+    if (timers == NULL || handle == 0 || slot >= timers->len)
+        return NULL;
+
+    timer = g_ptr_array_index (timers, slot);
+
+    if (timer->handle != handle)
+        return NULL;
+
+    return timer;
+}
+
+static guint
+timer_add (guint64 interval,
+           gboolean seconds,
+           GSourceFunc function,
+           gpointer data)
+{
+    HazeTimer *timer;
+    guint64 now = timer_now ();
+
+    if (timer_source == NULL)
+    {
+        timers = g_ptr_array_new ();
+        current_tick = now;
+        timer_source = g_source_new (&timer_source_funcs, sizeof (GSource));
+        g_source_attach (timer_source, NULL);
+    }
+
+    timer = timer_alloc ();
+    g_return_val_if_fail (timer != NULL, 0);
+
+    timer->interval = interval;
+    timer->seconds = seconds;
+    timer->function = function;
+    timer->data = data;
+
+    timer_set_expiry (timer, now);
+    wheel_insert (timer);
+
+    return timer->handle;
+}
+
+static guint
+haze_timeout_add (guint interval,
+                  GSourceFunc function,
+                  gpointer data)
+{
+    return timer_add (interval, FALSE, function, data);
+}
+
+static guint
+haze_timeout_add_seconds (guint interval,
+                          GSourceFunc function,
+                          gpointer data)
+{
+    /* Convert in 64 bits, so that intervals of more than 49 days don't wrap
+     * round and fire early */
+    return timer_add ((guint64) interval * 1000, TRUE, function, data);
+}
+
+static gboolean
+haze_timeout_remove (guint handle)
+{
+    HazeTimer *timer = timer_lookup (handle);
+
+    if (timer == NULL)
+    {
+        DEBUG ("no such timer %u", handle);
+        return FALSE;
+    }
+
+    wheel_remove (timer);
+
+    if (timer->dispatching)
+    {
+        /* timer_source_dispatch() will release it once the callback
+         * returns. */
+        timer->handle = 0;
+        timer->function = NULL;
+        timer->data = NULL;
+    }
+    else
+    {
+        timer_release (timer);
+    }
+
+    return TRUE;
+}
+
+/*** End of timers ***/
+
+static PurpleEventLoopUiOps haze_eventloop_ui_ops =
+{
+    haze_timeout_add,
+    haze_timeout_remove,
+    haze_input_add,
+    haze_input_remove,
+    NULL,
+    haze_timeout_add_seconds,
+
+    /* padding */
+    NULL,
+    NULL,
+    NULL
+};
+
+PurpleEventLoopUiOps *
+haze_eventloop_get_ui_ops (void)
+{
+    return &haze_eventloop_ui_ops;
+}
+
+static void
+free_input_watch (gpointer watch,
+                  gpointer unused)
+{
+    g_slice_free (HazeInputWatch, watch);
+}
+
+static void
+free_timer (gpointer timer,
+            gpointer unused)
+{
+    g_slice_free (HazeTimer, timer);
+}
+
+void
+haze_eventloop_uninit (void)
+{
+    if (input_source != NULL)
+    {
+        g_source_destroy (input_source);
+        g_source_unref (input_source);
+        input_source = NULL;
+
+        g_ptr_array_foreach (input_watches, free_input_watch, NULL);
+        g_ptr_array_free (input_watches, TRUE);
+        input_watches = NULL;
+        input_free_list = 0;
+    }
+
+    if (timer_source != NULL)
+    {
+        g_source_destroy (timer_source);
+        g_source_unref (timer_source);
+        timer_source = NULL;
+
+        memset (wheel_level0, 0, sizeof (wheel_level0));
+        memset (wheel_levels, 0, sizeof (wheel_levels));
+        expired_timers = NULL;
+        n_wheel_timers = 0;
+        next_tick = G_MAXUINT64;
+        next_tick_valid = TRUE;
+
+        g_ptr_array_foreach (timers, free_timer, NULL);
+        g_ptr_array_free (timers, TRUE);
+        timers = NULL;
+        timer_free_list = 0;
+    }
+}
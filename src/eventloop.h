@@ -0,0 +1,59 @@
+#ifndef __HAZE_EVENTLOOP_H__
+#define __HAZE_EVENTLOOP_H__
+/*
+ * eventloop.h - header for haze's libpurple event loop implementation
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib.h>
+
+#include <libpurple/eventloop.h>
+
+G_BEGIN_DECLS
+
+/* The handles returned by purple_timeout_add(), purple_timeout_add_seconds()
+ * and purple_input_add() are not GLib source IDs: they must only be passed to
+ * purple_timeout_remove() or purple_input_remove(), never to
+ * g_source_remove(), which would remove some unrelated source or fail.
+ *
+ * All input watches share one GSource, and all timers another, which makes
+ * adding and removing them cheap but has two costs compared with a GSource
+ * per watch:
+ *
+ *  - GLib doesn't dispatch a source from within its own dispatch function,
+ *    so if a libpurple callback runs a nested main loop, no other input
+ *    watch (or, from a timer, no other timer) is dispatched until it
+ *    returns, rather than only the watch whose callback is running. Nothing
+ *    in Haze or the prpls it is used with does this, since it would also
+ *    stall the D-Bus connection.
+ *
+ *  - Each main loop iteration scans every input watch slot ever allocated,
+ *    to check for and dispatch ready fds, so it costs O(slots) rather than
+ *    O(ready watches). Slots are recycled, so this is bounded by the
+ *    largest number of watches that have existed at once, which is roughly
+ *    the number of sockets the connected accounts hold open.
+ *
+ * tests/eventloop-benchmark compares both against a GSource per watch.
+ */
+PurpleEventLoopUiOps *haze_eventloop_get_ui_ops (void);
+
+void haze_eventloop_uninit (void);
+
+G_END_DECLS
+
+#endif /* __HAZE_EVENTLOOP_H__ */
@@ -24,6 +24,8 @@
 
 #include <string.h>
 
+#include <libpurple/eventloop.h>
+
 #include <telepathy-glib/telepathy-glib.h>
 #include <telepathy-glib/base-connection.h>
 #include <telepathy-glib/channel-manager.h>
@@ -473,7 +475,7 @@ haze_destroy_conversation (PurpleConversation *conv)
     ui_data = PURPLE_CONV_GET_HAZE_UI_DATA (conv);
 
     if (ui_data->resend_typing_timeout_id)
-        g_source_remove (ui_data->resend_typing_timeout_id);
+        purple_timeout_remove (ui_data->resend_typing_timeout_id);
 
     g_slice_free (HazeConversationUiData, ui_data);
     conv->ui_data = NULL;
@@ -35,7 +35,6 @@
 #include <libpurple/core.h>
 #include <libpurple/blist.h>
 #include <libpurple/version.h>
-#include <libpurple/eventloop.h>
 #include <libpurple/prefs.h>
 #include <libpurple/util.h>
 
@@ -48,97 +47,37 @@
 #endif
 
 #include <telepathy-glib/run.h>
+#include <telepathy-glib/util.h>
 
 #include "defines.h"
 #include "debug.h"
 #include "connection-manager.h"
+#include "contact-list.h"
+#include "eventloop.h"
+#include "manager-file.h"
 #include "notify.h"
+#include "protocol.h"
 #include "request.h"
+#include "shard.h"
+#include "state.h"
+#include "trace.h"
 #include "util.h"
+#include "watchdog.h"
 
 #ifdef ENABLE_MEDIA
 #include "media-backend.h"
 #endif
 
-/* Copied verbatim from nullclient, modulo changing whitespace. */
-#define PURPLE_GLIB_READ_COND  (G_IO_IN | G_IO_HUP | G_IO_ERR)
-#define PURPLE_GLIB_WRITE_COND (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
-
-typedef struct _PurpleGLibIOClosure {
-    PurpleInputFunction function;
-    guint result;
-    gpointer data;
-} PurpleGLibIOClosure;
-
-static void purple_glib_io_destroy(gpointer data)
-{
-    g_free(data);
-}
-
-static gboolean purple_glib_io_invoke(GIOChannel *source,
-                                      GIOCondition condition,
-                                      gpointer data)
-{
-    PurpleGLibIOClosure *closure = data;
-    PurpleInputCondition purple_cond = 0;
-
-    if (condition & PURPLE_GLIB_READ_COND)
-        purple_cond |= PURPLE_INPUT_READ;
-    if (condition & PURPLE_GLIB_WRITE_COND)
-        purple_cond |= PURPLE_INPUT_WRITE;
-
-    closure->function(closure->data, g_io_channel_unix_get_fd(source),
-                      purple_cond);
-
-    return TRUE;
-}
-
-static guint glib_input_add(gint fd,
-                            PurpleInputCondition condition,
-                            PurpleInputFunction function,
-                            gpointer data)
-{
-    PurpleGLibIOClosure *closure = g_new0(PurpleGLibIOClosure, 1);
-    GIOChannel *channel;
-    GIOCondition cond = 0;
-
-    closure->function = function;
-    closure->data = data;
-
-    if (condition & PURPLE_INPUT_READ)
-        cond |= PURPLE_GLIB_READ_COND;
-    if (condition & PURPLE_INPUT_WRITE)
-        cond |= PURPLE_GLIB_WRITE_COND;
-
-    channel = g_io_channel_unix_new(fd);
-    closure->result = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond,
-            purple_glib_io_invoke, closure, purple_glib_io_destroy);
-
-    g_io_channel_unref(channel);
-    return closure->result;
-}
-
-static PurpleEventLoopUiOps glib_eventloops = 
-{
-    g_timeout_add,
-    g_source_remove,
-    glib_input_add,
-    g_source_remove,
-    NULL,
-
-    /* padding */
-    NULL,
-    NULL,
-    NULL,
-    NULL
-};
-/*** End of the eventloop functions. ***/
-
 static char *user_dir = NULL;
 
 static void
 haze_ui_init (void)
 {
+    PurpleBlistUiOps *blist_ui_ops = haze_state_get_blist_ui_ops ();
+
+    if (blist_ui_ops != NULL)
+        purple_blist_set_ui_ops (blist_ui_ops);
+
     purple_accounts_set_ui_ops (haze_get_account_ui_ops ());
     purple_conversations_set_ui_ops (haze_get_conv_ui_ops ());
     purple_connections_set_ui_ops (haze_get_connection_ui_ops ());
@@ -175,25 +114,40 @@ set_libpurple_preferences (void)
 
 }
 
+/* If @use_state_dir is FALSE, HAZE_STATE_DIR is ignored, and a temporary
+ * directory is always used. */
 static void
-init_libpurple (void)
+init_libpurple (gboolean use_state_dir)
 {
-    user_dir = g_strconcat (g_get_tmp_dir (), G_DIR_SEPARATOR_S,
-                                  "haze-XXXXXX", NULL);
+    gint64 start = g_get_monotonic_time ();
 
-    if (!mkdtemp (user_dir)) {
-        g_error ("Couldn't make temporary conf directory: %s",
-                 strerror (errno));
+    if (use_state_dir)
+        user_dir = g_strdup (haze_state_dir_open ());
+
+    if (user_dir == NULL)
+    {
+        user_dir = g_strconcat (g_get_tmp_dir (), G_DIR_SEPARATOR_S,
+                                      "haze-XXXXXX", NULL);
+
+        if (!mkdtemp (user_dir)) {
+            g_error ("Couldn't make temporary conf directory: %s",
+                     strerror (errno));
+        }
     }
 
     purple_util_set_user_dir (user_dir);
 
     purple_core_set_ui_ops(&haze_core_uiops);
 
-    purple_eventloop_set_ui_ops(&glib_eventloops);
+    purple_eventloop_set_ui_ops (haze_eventloop_get_ui_ops ());
+
+    haze_trace_begin ("purple_core_init");
 
     if (!purple_core_init(UI_ID))
         g_error ("libpurple initialization failed.  :-/");
+
+    haze_trace_probe (NULL);
+    haze_trace_end ("purple_core_init");
 #ifdef HAVE_PURPLE_DBUS_UNINIT
     /* purple_core_init () calls purple_dbus_init ().  We don't want libpurple's
      * own dbus server, so let's kill it here.  Ideally, it would never be
@@ -202,10 +156,14 @@ init_libpurple (void)
     purple_dbus_uninit ();
 #endif
 
+    haze_trace_begin ("purple_blist_load");
     purple_set_blist(purple_blist_new());
     purple_blist_load();
+    haze_trace_end ("purple_blist_load");
 
+    haze_trace_begin ("purple_prefs_load");
     purple_prefs_load();
+    haze_trace_end ("purple_prefs_load");
 
     DEBUG ("libpurple %d.%d.%d loaded (compiled against %d.%d.%d)",
         purple_major_version, purple_minor_version, purple_micro_version,
@@ -213,16 +171,29 @@ init_libpurple (void)
 
     set_libpurple_preferences ();
 
+    DEBUG ("libpurple started from %s state in %" G_GINT64_FORMAT " ms",
+        haze_state_dir_is_warm () ? "warm" : "cold",
+        (g_get_monotonic_time () - start) / 1000);
+
 #ifdef ENABLE_MEDIA
     purple_media_manager_set_backend_type (purple_media_manager_get (),
         HAZE_TYPE_MEDIA_BACKEND);
 #endif
 }
 
+static gboolean
+startup_finished_cb (gpointer data)
+{
+    haze_trace_end ("bus name");
+    haze_trace_finish ();
+    return FALSE;
+}
+
 static TpBaseConnectionManager *
 get_cm (void)
 {
     GLogLevelFlags fatal_mask;
+    TpBaseConnectionManager *cm;
 
     /* libpurple throws critical errors all over the place because of
      * g_return_val_if_fail().
@@ -236,22 +207,77 @@ get_cm (void)
     g_log_set_fatal_mask ("tp-glib",
         g_log_set_fatal_mask ("tp-glib", 0) | G_LOG_LEVEL_CRITICAL);
 
-    return (TpBaseConnectionManager *) g_object_new (HAZE_TYPE_CONNECTION_MANAGER, NULL);
+    haze_trace_begin ("HazeConnectionManager");
+    cm = (TpBaseConnectionManager *) g_object_new (HAZE_TYPE_CONNECTION_MANAGER, NULL);
+    haze_trace_end ("HazeConnectionManager");
+
+    haze_watchdog_watch_bus ();
+
+    /* tp_run_connection_manager() claims the bus name before entering the
+     * main loop, so by the time this runs startup is over.
+     */
+    haze_trace_begin ("bus name");
+    g_idle_add (startup_finished_cb, NULL);
+
+    return cm;
 }
 
 static void
 delete_user_dir (void)
 {
-    if (!haze_remove_directory (user_dir))
+    if (!haze_state_dir_is_persistent () && !haze_remove_directory (user_dir))
         g_warning ("couldn't delete %s", user_dir);
+
+    haze_contact_list_forget_rosters ();
+    haze_state_dir_close ();
     g_free (user_dir);
 }
 
+/* Prints a .manager file describing the protocols provided by the libpurple
+ * plugins installed on this machine, for use at build time.
+ */
+static int
+print_manager_file (void)
+{
+    GList *protocols;
+    GError *error = NULL;
+    gchar *contents;
+    int ret = 0;
+
+    /* tp_run_connection_manager() would otherwise do this for us. */
+    g_type_init ();
+
+    protocols = haze_protocol_build_list ();
+    contents = haze_manager_file_contents ("haze", protocols, &error);
+
+    if (contents == NULL)
+    {
+        g_printerr ("%s\n", error->message);
+        g_error_free (error);
+        ret = 1;
+    }
+    else
+    {
+        g_print ("%s", contents);
+        g_free (contents);
+    }
+
+    g_list_foreach (protocols, (GFunc) g_object_unref, NULL);
+    g_list_free (protocols);
+
+    return ret;
+}
+
 int
 main(int argc,
      char **argv)
 {
     int ret = 0;
+    HazeShardRole shard_role = HAZE_SHARD_NONE;
+    /* This runs at build time, so the developer's environment shouldn't
+     * affect it, and it shouldn't touch their state directory */
+    gboolean print_manager = (argc == 2 &&
+        !tp_strdiff (argv[1], "--print-manager-file"));
 
     if (!dbus_threads_init_default ())
         g_error ("Unable to initialize libdbus for thread-safety "
@@ -259,15 +285,39 @@ main(int argc,
 
     g_set_prgname(UI_ID);
 
-    haze_debug_set_flags_from_env ();
+    if (!print_manager)
+    {
+        /* Workers must be forked before libpurple or the bus connection
+         * exist */
+        shard_role = haze_shard_fork_workers ();
+        haze_debug_set_flags_from_env ();
+
+        /* Only one process may write the trace */
+        if (shard_role != HAZE_SHARD_WORKER)
+            haze_trace_init ();
+
+        haze_watchdog_init ();
+    }
 
     signal (SIGCHLD, SIG_IGN);
-    init_libpurple();
 
-    ret = tp_run_connection_manager (UI_ID, PACKAGE_VERSION, get_cm, argc,
-                                     argv);
+    /* Only one process may use the state directory at a time */
+    init_libpurple (!print_manager && shard_role != HAZE_SHARD_WORKER);
+
+    if (print_manager)
+        ret = print_manager_file ();
+    else if (shard_role == HAZE_SHARD_WORKER)
+        ret = haze_shard_run_worker (get_cm);
+    else if (shard_role == HAZE_SHARD_SUPERVISOR)
+        ret = haze_shard_run_supervisor (get_cm);
+    else
+        ret = tp_run_connection_manager (UI_ID, PACKAGE_VERSION, get_cm, argc,
+                                         argv);
 
+    haze_trace_finish ();
     purple_core_quit ();
+    haze_watchdog_uninit ();
+    haze_eventloop_uninit ();
     delete_user_dir ();
 
     return ret;
@@ -0,0 +1,263 @@
+/*
+ * manager-file.c - writes haze's .manager file
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "config.h"
+#include "manager-file.h"
+
+#include <dbus/dbus-protocol.h>
+#include <telepathy-glib/telepathy-glib.h>
+
+/* Writes the .manager file which lets account managers list haze's protocols
+ * and their parameters without activating it; see the "Connection manager
+ * files" section of the Telepathy specification.
+ */
+
+static void
+write_strv (GKeyFile *f,
+    const gchar *group,
+    const gchar *key,
+    const gchar * const *strv)
+{
+  if (strv == NULL)
+    return;
+
+  g_key_file_set_string_list (f, group, key, strv, g_strv_length (
+        (gchar **) strv));
+}
+
+static void
+write_string (GKeyFile *f,
+    const gchar *group,
+    const gchar *key,
+    const gchar *value)
+{
+  if (!tp_str_empty (value))
+    g_key_file_set_string (f, group, key, value);
+}
+
+static gboolean
+write_param (GKeyFile *f,
+    const gchar *group,
+    const TpCMParamSpec *row,
+    GError **error)
+{
+  gchar *key = g_strdup_printf ("param-%s", row->name);
+  gchar *value = g_strdup_printf ("%s%s%s%s", row->dtype,
+      (row->flags & TP_CONN_MGR_PARAM_FLAG_REQUIRED) ? " required" : "",
+      (row->flags & TP_CONN_MGR_PARAM_FLAG_REGISTER) ? " register" : "",
+      (row->flags & TP_CONN_MGR_PARAM_FLAG_SECRET) ? " secret" : "");
+  gboolean ret = TRUE;
+
+  g_key_file_set_string (f, group, key, value);
+  g_free (value);
+  g_free (key);
+
+  if (!(row->flags & TP_CONN_MGR_PARAM_FLAG_HAS_DEFAULT))
+    return TRUE;
+
+  key = g_strdup_printf ("default-%s", row->name);
+
+  switch (row->dtype[0])
+    {
+      case DBUS_TYPE_STRING:
+        /* The usersplit parameters default to NULL, which the CM reports as
+         * "" */
+        g_key_file_set_string (f, group, key,
+            row->def != NULL ? row->def : "");
+        break;
+      case DBUS_TYPE_INT16:
+      case DBUS_TYPE_INT32:
+        g_key_file_set_integer (f, group, key, GPOINTER_TO_INT (row->def));
+        break;
+      case DBUS_TYPE_UINT16:
+      case DBUS_TYPE_UINT32:
+        g_key_file_set_uint64 (f, group, key, GPOINTER_TO_UINT (row->def));
+        break;
+      case DBUS_TYPE_BOOLEAN:
+        g_key_file_set_boolean (f, group, key, GPOINTER_TO_INT (row->def));
+        break;
+      default:
+        g_set_error (error, TP_ERROR, TP_ERROR_NOT_IMPLEMENTED,
+            "parameter '%s' has a default of unsupported type '%s'",
+            row->name, row->dtype);
+        ret = FALSE;
+    }
+
+  g_free (key);
+  return ret;
+}
+
+static gboolean
+write_fixed_property (GKeyFile *f,
+    const gchar *group,
+    const gchar *name,
+    const GValue *value,
+    GError **error)
+{
+  gchar *key;
+
+  if (G_VALUE_HOLDS_STRING (value))
+    {
+      key = g_strdup_printf ("%s s", name);
+      g_key_file_set_string (f, group, key, g_value_get_string (value));
+    }
+  else if (G_VALUE_HOLDS_UINT (value))
+    {
+      key = g_strdup_printf ("%s u", name);
+      g_key_file_set_uint64 (f, group, key, g_value_get_uint (value));
+    }
+  else if (G_VALUE_HOLDS_INT (value))
+    {
+      key = g_strdup_printf ("%s i", name);
+      g_key_file_set_integer (f, group, key, g_value_get_int (value));
+    }
+  else if (G_VALUE_HOLDS_BOOLEAN (value))
+    {
+      key = g_strdup_printf ("%s b", name);
+      g_key_file_set_boolean (f, group, key, g_value_get_boolean (value));
+    }
+  else
+    {
+      g_set_error (error, TP_ERROR, TP_ERROR_NOT_IMPLEMENTED,
+          "fixed property '%s' has unsupported type %s", name,
+          G_VALUE_TYPE_NAME (value));
+      return FALSE;
+    }
+
+  g_free (key);
+  return TRUE;
+}
+
+static gboolean
+write_protocol (GKeyFile *f,
+    TpBaseProtocol *protocol,
+    GError **error)
+{
+  const gchar *name = tp_base_protocol_get_name (protocol);
+  gchar *group = g_strdup_printf ("Protocol %s", name);
+  GHashTable *props = tp_base_protocol_get_immutable_properties (protocol);
+  const TpCMParamSpec *row;
+  GPtrArray *rccs;
+  GPtrArray *rcc_groups = g_ptr_array_new_with_free_func (g_free);
+  gboolean ret = FALSE;
+  guint i;
+
+  for (row = tp_base_protocol_get_parameters (protocol);
+      row->name != NULL;
+      row++)
+    {
+      if (!write_param (f, group, row, error))
+        goto out;
+    }
+
+  write_strv (f, group, "Interfaces",
+      tp_asv_get_strv (props, TP_PROP_PROTOCOL_INTERFACES));
+  write_strv (f, group, "ConnectionInterfaces",
+      tp_asv_get_strv (props, TP_PROP_PROTOCOL_CONNECTION_INTERFACES));
+  write_strv (f, group, "AuthenticationTypes",
+      tp_asv_get_strv (props, TP_PROP_PROTOCOL_AUTHENTICATION_TYPES));
+  write_string (f, group, "VCardField",
+      tp_asv_get_string (props, TP_PROP_PROTOCOL_VCARD_FIELD));
+  write_string (f, group, "EnglishName",
+      tp_asv_get_string (props, TP_PROP_PROTOCOL_ENGLISH_NAME));
+  write_string (f, group, "Icon",
+      tp_asv_get_string (props, TP_PROP_PROTOCOL_ICON));
+
+  rccs = tp_asv_get_boxed (props,
+      TP_PROP_PROTOCOL_REQUESTABLE_CHANNEL_CLASSES,
+      TP_ARRAY_TYPE_REQUESTABLE_CHANNEL_CLASS_LIST);
+
+  for (i = 0; rccs != NULL && i < rccs->len; i++)
+    {
+      GHashTable *fixed;
+      const gchar * const *allowed;
+      gchar *rcc_group = g_strdup_printf ("%s-%u", name, i);
+      GHashTableIter iter;
+      gpointer k, v;
+
+      tp_value_array_unpack (g_ptr_array_index (rccs, i), 2, &fixed,
+          &allowed);
+
+      g_hash_table_iter_init (&iter, fixed);
+
+      while (g_hash_table_iter_next (&iter, &k, &v))
+        {
+          if (!write_fixed_property (f, rcc_group, k, v, error))
+            {
+              g_free (rcc_group);
+              goto out;
+            }
+        }
+
+      write_strv (f, rcc_group, "allowed", allowed);
+      g_ptr_array_add (rcc_groups, rcc_group);
+    }
+
+  g_ptr_array_add (rcc_groups, NULL);
+  write_strv (f, group, "RequestableChannelClasses",
+      (const gchar * const *) rcc_groups->pdata);
+
+  ret = TRUE;
+
+out:
+  g_ptr_array_unref (rcc_groups);
+  g_hash_table_unref (props);
+  g_free (group);
+  return ret;
+}
+
+/**
+ * haze_manager_file_contents:
+ * @cm_name: the connection manager's name, as in its bus name
+ * @protocols: a list of #TpBaseProtocol
+ * @error: used to report protocols which cannot be described in a .manager
+ *         file
+ *
+ * Returns: the contents of a .manager file describing @protocols, or %NULL
+ *          with @error set.
+ */
+gchar *
+haze_manager_file_contents (const gchar *cm_name,
+    GList *protocols,
+    GError **error)
+{
+  GKeyFile *f = g_key_file_new ();
+  gchar *bus_name = g_strconcat (TP_CM_BUS_NAME_BASE, cm_name, NULL);
+  gchar *object_path = g_strconcat (TP_CM_OBJECT_PATH_BASE, cm_name, NULL);
+  gchar *ret = NULL;
+  GList *l;
+
+  g_key_file_set_string (f, "ConnectionManager", "BusName", bus_name);
+  g_key_file_set_string (f, "ConnectionManager", "ObjectPath", object_path);
+
+  for (l = protocols; l != NULL; l = l->next)
+    {
+      if (!write_protocol (f, l->data, error))
+        goto out;
+    }
+
+  ret = g_key_file_to_data (f, NULL, NULL);
+
+out:
+  g_free (object_path);
+  g_free (bus_name);
+  g_key_file_free (f);
+  return ret;
+}
@@ -0,0 +1,795 @@
+/*
+ * shard.c - spreading haze's connections over several processes
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "config.h"
+
+#include "shard.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include <telepathy-glib/base-connection.h>
+#include <telepathy-glib/dbus.h>
+#include <telepathy-glib/debug.h>
+#include <telepathy-glib/interfaces.h>
+#include <telepathy-glib/proxy.h>
+#include <telepathy-glib/util.h>
+
+#include "debug.h"
+
+/* Every account in a process shares one main loop, and one libpurple, so a
+ * slow or crashing prpl affects all of them.  If HAZE_SHARDS is set to a
+ * number of workers, Haze forks that many worker processes before
+ * initializing libpurple, each with its own libpurple core and temporary
+ * user directory.
+ *
+ * The original process, the supervisor, owns the connection manager's bus
+ * name and answers everything except RequestConnection itself.  It forwards
+ * each RequestConnection call to the worker with the fewest connections
+ * (counting requests which haven't been answered yet), breaking ties by the
+ * worker's main loop lag, and relays the reply.  The worker makes the
+ * connection, so the connection's bus name and object belong to it.  If no
+ * worker is running, the supervisor makes the connection itself.
+ *
+ * Each worker tells the supervisor its unique bus name, and then its load,
+ * over a socket pair, one line per message:
+ *
+ *   name <unique bus name>
+ *   load <connections> <main loop lag in ms>
+ *
+ * The supervisor exits like any other connection manager, once no process
+ * has had any connections for a while.  Closing the sockets tells the
+ * workers to exit once their last connection has gone.
+ */
+
+#define MAX_SHARDS 64
+
+/* As in tp_run_connection_manager() */
+#define DIE_TIME 5000
+
+/* How long the supervisor waits for a worker to be ready before claiming
+ * the bus name anyway */
+#define STARTUP_TIMEOUT 10000
+
+/* How often workers measure their main loop's lag */
+#define LAG_INTERVAL 1000
+
+/* Workers only report a change of lag this big */
+#define LAG_GRANULARITY 10
+
+typedef struct _HazeShard HazeShard;
+struct _HazeShard {
+    guint index;
+    GPid pid;
+    gint fd;
+    GIOChannel *channel;
+    guint watch_id;
+
+    /* The worker's unique bus name, once it's ready */
+    gchar *name;
+    guint connections;
+    guint lag_ms;
+    /* RequestConnection calls forwarded but not yet answered */
+    guint in_flight;
+    gboolean dead;
+};
+
+typedef struct _HazeShardRequest HazeShardRequest;
+struct _HazeShardRequest {
+    HazeShard *shard;
+    DBusMessage *call;
+};
+
+static HazeShard *shards = NULL;
+static guint n_shards = 0;
+
+/* In a worker, the socket to the supervisor */
+static gint supervisor_fd = -1;
+static guint worker_index = 0;
+
+static GMainLoop *main_loop = NULL;
+static DBusConnection *bus_connection = NULL;
+static TpBaseConnectionManager *manager = NULL;
+
+/* Connections made by this process */
+static guint local_connections = 0;
+static void (*connections_changed) (void) = NULL;
+
+static void
+connection_shutdown_finished_cb (TpBaseConnection *conn,
+                                 gpointer data)
+{
+    g_assert (local_connections > 0);
+    local_connections--;
+    connections_changed ();
+}
+
+static void
+new_connection_cb (TpBaseConnectionManager *cm,
+                   gchar *bus_name,
+                   gchar *object_path,
+                   TpBaseConnection *conn,
+                   gpointer data)
+{
+    local_connections++;
+    g_signal_connect (conn, "shutdown-finished",
+        G_CALLBACK (connection_shutdown_finished_cb), NULL);
+    connections_changed ();
+}
+
+/* Connects to the bus, and constructs the connection manager. */
+static gboolean
+start_manager (HazeShardConstructor construct_cm)
+{
+    TpDBusDaemon *bus;
+    GError *error = NULL;
+
+    g_type_init ();
+
+    bus = tp_dbus_daemon_dup (&error);
+
+    if (bus == NULL)
+    {
+        g_warning ("%s", error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    bus_connection = dbus_connection_ref (dbus_g_connection_get_connection (
+        tp_proxy_get_dbus_connection (bus)));
+    g_object_unref (bus);
+
+    manager = construct_cm ();
+    g_signal_connect (manager, "new-connection",
+        G_CALLBACK (new_connection_cb), NULL);
+
+    main_loop = g_main_loop_new (NULL, FALSE);
+    return TRUE;
+}
+
+static void
+stop_manager (void)
+{
+    g_object_unref (manager);
+    manager = NULL;
+    dbus_connection_unref (bus_connection);
+    bus_connection = NULL;
+    g_main_loop_unref (main_loop);
+    main_loop = NULL;
+}
+
+/**
+ * haze_shard_fork_workers:
+ *
+ * If HAZE_SHARDS is set, forks that many workers.  Must be called before
+ * anything connects to the bus or initializes libpurple.
+ *
+ * Returns: this process's role
+ */
+HazeShardRole
+haze_shard_fork_workers (void)
+{
+    const gchar *env = g_getenv ("HAZE_SHARDS");
+    guint wanted, i;
+
+    if (env == NULL)
+        return HAZE_SHARD_NONE;
+
+    wanted = strtoul (env, NULL, 10);
+
+    if (wanted == 0)
+        return HAZE_SHARD_NONE;
+
+    if (wanted > MAX_SHARDS)
+    {
+        g_warning ("HAZE_SHARDS=%u is too many; using %u", wanted, MAX_SHARDS);
+        wanted = MAX_SHARDS;
+    }
+
+    shards = g_new0 (HazeShard, wanted);
+
+    for (i = 0; i < wanted; i++)
+    {
+        gint fds[2];
+        pid_t pid;
+
+        if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            g_warning ("couldn't create a socket for worker %u: %s", i,
+                g_strerror (errno));
+            break;
+        }
+
+        pid = fork ();
+
+        if (pid < 0)
+        {
+            g_warning ("couldn't fork worker %u: %s", i, g_strerror (errno));
+            close (fds[0]);
+            close (fds[1]);
+            break;
+        }
+
+        if (pid == 0)
+        {
+            guint j;
+
+            /* Earlier workers' sockets belong to the supervisor */
+            for (j = 0; j < n_shards; j++)
+                close (shards[j].fd);
+
+            close (fds[0]);
+            g_free (shards);
+            shards = NULL;
+            n_shards = 0;
+
+            supervisor_fd = fds[1];
+            worker_index = i;
+            return HAZE_SHARD_WORKER;
+        }
+
+        close (fds[1]);
+        shards[n_shards].index = i;
+        shards[n_shards].pid = pid;
+        shards[n_shards].fd = fds[0];
+        n_shards++;
+    }
+
+    if (n_shards == 0)
+    {
+        g_free (shards);
+        shards = NULL;
+        return HAZE_SHARD_NONE;
+    }
+
+    return HAZE_SHARD_SUPERVISOR;
+}
+
+/* Worker */
+
+static gboolean supervisor_gone = FALSE;
+static guint reported_connections = G_MAXUINT;
+static guint reported_lag = 0;
+static guint lag_ms = 0;
+static gint64 lag_expected = 0;
+
+static void
+tell_supervisor (const gchar *format,
+                 ...) G_GNUC_PRINTF (1, 2);
+
+static void
+tell_supervisor (const gchar *format,
+                 ...)
+{
+    va_list args;
+    gchar *line;
+    gsize len;
+
+    if (supervisor_gone)
+        return;
+
+    va_start (args, format);
+    line = g_strdup_vprintf (format, args);
+    va_end (args);
+
+    len = strlen (line);
+
+    /* The lines are much shorter than a socket's buffer, so they are only
+     * ever written partially if the supervisor has stopped reading */
+    if (send (supervisor_fd, line, len, MSG_NOSIGNAL) != (gssize) len)
+        DEBUG ("worker %u: couldn't write to the supervisor: %s",
+            worker_index, g_strerror (errno));
+
+    g_free (line);
+}
+
+static void
+report_load (void)
+{
+    guint lag_change = (lag_ms > reported_lag ? lag_ms - reported_lag
+        : reported_lag - lag_ms);
+
+    if (local_connections == reported_connections &&
+        lag_change < LAG_GRANULARITY)
+        return;
+
+    reported_connections = local_connections;
+    reported_lag = lag_ms;
+    tell_supervisor ("load %u %u\n", local_connections, lag_ms);
+}
+
+static void
+worker_connections_changed (void)
+{
+    report_load ();
+
+    if (supervisor_gone && local_connections == 0)
+        g_main_loop_quit (main_loop);
+}
+
+static gboolean
+measure_lag_cb (gpointer data)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    lag_ms = (now > lag_expected ? (now - lag_expected) / 1000 : 0);
+    lag_expected = now + LAG_INTERVAL * 1000;
+    report_load ();
+
+    return TRUE;
+}
+
+static gboolean
+supervisor_io_cb (GIOChannel *source,
+                  GIOCondition condition,
+                  gpointer data)
+{
+    gchar buf[64];
+
+    /* The supervisor never writes anything, so this means it has exited */
+    if (condition & G_IO_IN && read (supervisor_fd, buf, sizeof (buf)) > 0)
+        return TRUE;
+
+    DEBUG ("worker %u: the supervisor has gone; %u connections left",
+        worker_index, local_connections);
+    supervisor_gone = TRUE;
+
+    if (local_connections == 0)
+        g_main_loop_quit (main_loop);
+
+    return FALSE;
+}
+
+/**
+ * haze_shard_run_worker:
+ * @construct_cm: returns a new connection manager
+ *
+ * Exports a connection manager without claiming its bus name, tells the
+ * supervisor where to find it, and runs until the supervisor has gone and
+ * so have all the connections.
+ */
+int
+haze_shard_run_worker (HazeShardConstructor construct_cm)
+{
+    TpDBusDaemon *bus;
+    GIOChannel *channel;
+    gchar *path;
+    guint lag_id, watch_id;
+
+    g_assert (supervisor_fd >= 0);
+
+    if (!start_manager (construct_cm))
+        return 1;
+
+    connections_changed = worker_connections_changed;
+
+    /* Only the supervisor claims the connection manager's well-known name;
+     * the connections this process makes claim their own. */
+    bus = tp_dbus_daemon_dup (NULL);
+    path = g_strconcat (TP_CM_OBJECT_PATH_BASE,
+        TP_BASE_CONNECTION_MANAGER_GET_CLASS (manager)->cm_dbus_name, NULL);
+    tp_dbus_daemon_register_object (bus, path, manager);
+    g_free (path);
+    g_object_unref (bus);
+
+    channel = g_io_channel_unix_new (supervisor_fd);
+    watch_id = g_io_add_watch (channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+        supervisor_io_cb, NULL);
+    g_io_channel_unref (channel);
+
+    lag_expected = g_get_monotonic_time () + LAG_INTERVAL * 1000;
+    lag_id = g_timeout_add (LAG_INTERVAL, measure_lag_cb, NULL);
+
+    DEBUG ("worker %u is %s", worker_index,
+        dbus_bus_get_unique_name (bus_connection));
+    tell_supervisor ("name %s\n", dbus_bus_get_unique_name (bus_connection));
+    report_load ();
+
+    g_main_loop_run (main_loop);
+
+    g_source_remove (lag_id);
+
+    if (!supervisor_gone)
+        g_source_remove (watch_id);
+
+    close (supervisor_fd);
+    supervisor_fd = -1;
+    stop_manager ();
+
+    return 0;
+}
+
+/* Supervisor */
+
+static gboolean registered = FALSE;
+static guint startup_id = 0;
+static guint die_id = 0;
+static gint ret = 0;
+
+static gboolean
+die_cb (gpointer data)
+{
+    DEBUG ("no connections for %u ms; exiting", DIE_TIME);
+    die_id = 0;
+    g_main_loop_quit (main_loop);
+    return FALSE;
+}
+
+/* Exits, like tp_run_connection_manager(), once there have been no
+ * connections in any process for a while */
+static void
+check_idle (void)
+{
+    guint total = local_connections;
+    guint i;
+
+    if (!registered)
+        return;
+
+    for (i = 0; i < n_shards; i++)
+    {
+        if (!shards[i].dead)
+            total += shards[i].connections + shards[i].in_flight;
+    }
+
+    if (total == 0 && !tp_debug_get_persistent ())
+    {
+        if (die_id == 0)
+            die_id = g_timeout_add (DIE_TIME, die_cb, NULL);
+    }
+    else if (die_id != 0)
+    {
+        g_source_remove (die_id);
+        die_id = 0;
+    }
+}
+
+static void
+register_manager (void)
+{
+    if (registered)
+        return;
+
+    if (startup_id != 0)
+    {
+        g_source_remove (startup_id);
+        startup_id = 0;
+    }
+
+    registered = TRUE;
+
+    if (!tp_base_connection_manager_register (manager))
+    {
+        ret = 1;
+        g_main_loop_quit (main_loop);
+        return;
+    }
+
+    check_idle ();
+}
+
+static gboolean
+startup_timeout_cb (gpointer data)
+{
+    DEBUG ("no worker is ready after %u ms; claiming the bus name anyway",
+        STARTUP_TIMEOUT);
+    startup_id = 0;
+    register_manager ();
+    return FALSE;
+}
+
+static gboolean
+all_shards_dead (void)
+{
+    guint i;
+
+    for (i = 0; i < n_shards; i++)
+    {
+        if (!shards[i].dead)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+shard_died (HazeShard *shard)
+{
+    DEBUG ("worker %u (pid %d) has exited with %u connections",
+        shard->index, (gint) shard->pid, shard->connections);
+
+    shard->dead = TRUE;
+    shard->watch_id = 0;
+    g_io_channel_unref (shard->channel);
+    shard->channel = NULL;
+    close (shard->fd);
+    shard->fd = -1;
+
+    if (all_shards_dead ())
+    {
+        DEBUG ("no workers left; making connections in the supervisor");
+        register_manager ();
+    }
+
+    check_idle ();
+}
+
+static void
+shard_handle_line (HazeShard *shard,
+                   const gchar *line)
+{
+    guint connections, lag;
+
+    if (g_str_has_prefix (line, "name "))
+    {
+        g_free (shard->name);
+        shard->name = g_strdup (line + strlen ("name "));
+        DEBUG ("worker %u (pid %d) is ready as %s", shard->index,
+            (gint) shard->pid, shard->name);
+        register_manager ();
+    }
+    else if (sscanf (line, "load %u %u", &connections, &lag) == 2)
+    {
+        shard->connections = connections;
+        shard->lag_ms = lag;
+        check_idle ();
+    }
+    else
+    {
+        g_warning ("worker %u sent something unexpected: %s", shard->index,
+            line);
+    }
+}
+
+static gboolean
+shard_io_cb (GIOChannel *source,
+             GIOCondition condition,
+             gpointer data)
+{
+    HazeShard *shard = data;
+
+    while (TRUE)
+    {
+        gchar *line = NULL;
+        gsize terminator;
+        GIOStatus status;
+
+        status = g_io_channel_read_line (source, &line, NULL, &terminator,
+            NULL);
+
+        if (status == G_IO_STATUS_AGAIN)
+            return TRUE;
+
+        if (status != G_IO_STATUS_NORMAL)
+        {
+            g_free (line);
+            shard_died (shard);
+            return FALSE;
+        }
+
+        line[terminator] = '\0';
+        shard_handle_line (shard, line);
+        g_free (line);
+    }
+}
+
+/* Returns the running worker which should make the next connection, or
+ * NULL */
+static HazeShard *
+least_loaded_shard (void)
+{
+    HazeShard *best = NULL;
+    guint i;
+
+    for (i = 0; i < n_shards; i++)
+    {
+        HazeShard *shard = shards + i;
+
+        if (shard->dead || shard->name == NULL)
+            continue;
+
+        if (best == NULL ||
+            shard->connections + shard->in_flight <
+                best->connections + best->in_flight ||
+            (shard->connections + shard->in_flight ==
+                best->connections + best->in_flight &&
+             shard->lag_ms < best->lag_ms))
+            best = shard;
+    }
+
+    return best;
+}
+
+static void
+request_free (gpointer data)
+{
+    HazeShardRequest *request = data;
+
+    dbus_message_unref (request->call);
+    g_slice_free (HazeShardRequest, request);
+}
+
+static void
+request_reply_cb (DBusPendingCall *pending,
+                  void *data)
+{
+    HazeShardRequest *request = data;
+    DBusMessage *reply = dbus_pending_call_steal_reply (pending);
+
+    g_assert (request->shard->in_flight > 0);
+    request->shard->in_flight--;
+
+    if (reply != NULL)
+    {
+        if (!dbus_message_get_no_reply (request->call))
+        {
+            DBusMessage *forwarded = dbus_message_copy (reply);
+
+            dbus_message_set_sender (forwarded, NULL);
+            dbus_message_set_destination (forwarded,
+                dbus_message_get_sender (request->call));
+            dbus_message_set_reply_serial (forwarded,
+                dbus_message_get_serial (request->call));
+            dbus_connection_send (bus_connection, forwarded, NULL);
+            dbus_message_unref (forwarded);
+        }
+
+        dbus_message_unref (reply);
+    }
+
+    dbus_pending_call_unref (pending);
+    check_idle ();
+}
+
+static DBusHandlerResult
+request_connection_filter (DBusConnection *connection,
+                           DBusMessage *message,
+                           void *data)
+{
+    const gchar *path = data;
+    HazeShard *shard;
+    HazeShardRequest *request;
+    DBusMessage *forwarded;
+    DBusPendingCall *pending = NULL;
+
+    if (!dbus_message_is_method_call (message, TP_IFACE_CONNECTION_MANAGER,
+            "RequestConnection") ||
+        tp_strdiff (dbus_message_get_path (message), path))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    shard = least_loaded_shard ();
+
+    /* Make the connection here */
+    if (shard == NULL)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    forwarded = dbus_message_copy (message);
+    dbus_message_set_sender (forwarded, NULL);
+    dbus_message_set_destination (forwarded, shard->name);
+
+    if (!dbus_connection_send_with_reply (connection, forwarded, &pending, -1)
+        || pending == NULL)
+    {
+        dbus_message_unref (forwarded);
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+
+    dbus_message_unref (forwarded);
+
+    DEBUG ("sending RequestConnection from %s to worker %u: %u connections, "
+        "%u in flight, %u ms lag", dbus_message_get_sender (message),
+        shard->index, shard->connections, shard->in_flight, shard->lag_ms);
+
+    request = g_slice_new (HazeShardRequest);
+    request->shard = shard;
+    request->call = dbus_message_ref (message);
+    shard->in_flight++;
+    check_idle ();
+
+    dbus_pending_call_set_notify (pending, request_reply_cb, request,
+        request_free);
+
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/**
+ * haze_shard_run_supervisor:
+ * @construct_cm: returns a new connection manager
+ *
+ * Claims the connection manager's bus name once a worker is ready, and
+ * sends connection requests to the workers until there have been no
+ * connections for a while.
+ */
+int
+haze_shard_run_supervisor (HazeShardConstructor construct_cm)
+{
+    gchar *path;
+    guint i;
+
+    g_assert (n_shards > 0);
+
+    if (!start_manager (construct_cm))
+        return 1;
+
+    connections_changed = check_idle;
+
+    for (i = 0; i < n_shards; i++)
+    {
+        HazeShard *shard = shards + i;
+
+        shard->channel = g_io_channel_unix_new (shard->fd);
+        g_io_channel_set_encoding (shard->channel, NULL, NULL);
+        g_io_channel_set_flags (shard->channel, G_IO_FLAG_NONBLOCK, NULL);
+        shard->watch_id = g_io_add_watch (shard->channel,
+            G_IO_IN | G_IO_HUP | G_IO_ERR, shard_io_cb, shard);
+    }
+
+    path = g_strconcat (TP_CM_OBJECT_PATH_BASE,
+        TP_BASE_CONNECTION_MANAGER_GET_CLASS (manager)->cm_dbus_name, NULL);
+    dbus_connection_add_filter (bus_connection, request_connection_filter,
+        path, NULL);
+
+    startup_id = g_timeout_add (STARTUP_TIMEOUT, startup_timeout_cb, NULL);
+
+    g_main_loop_run (main_loop);
+
+    dbus_connection_remove_filter (bus_connection, request_connection_filter,
+        path);
+    g_free (path);
+
+    if (startup_id != 0)
+        g_source_remove (startup_id);
+
+    if (die_id != 0)
+        g_source_remove (die_id);
+
+    /* Closing the sockets tells the workers to exit once their connections
+     * have gone */
+    for (i = 0; i < n_shards; i++)
+    {
+        HazeShard *shard = shards + i;
+
+        if (!shard->dead)
+        {
+            g_source_remove (shard->watch_id);
+            g_io_channel_unref (shard->channel);
+            close (shard->fd);
+        }
+
+        g_free (shard->name);
+    }
+
+    g_free (shards);
+    shards = NULL;
+    n_shards = 0;
+
+    stop_manager ();
+
+    return ret;
+}
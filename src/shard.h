@@ -0,0 +1,49 @@
+#ifndef __HAZE_SHARD_H__
+#define __HAZE_SHARD_H__
+/*
+ * shard.h - header for haze's multi-process mode
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib.h>
+
+#include <telepathy-glib/base-connection-manager.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    /* HAZE_SHARDS is not set: this is an ordinary connection manager */
+    HAZE_SHARD_NONE,
+    /* This process owns the connection manager's bus name, and hands
+     * RequestConnection calls to the workers */
+    HAZE_SHARD_SUPERVISOR,
+    /* This process makes connections when the supervisor asks */
+    HAZE_SHARD_WORKER
+} HazeShardRole;
+
+typedef TpBaseConnectionManager *(*HazeShardConstructor) (void);
+
+HazeShardRole haze_shard_fork_workers (void);
+
+int haze_shard_run_supervisor (HazeShardConstructor construct_cm);
+
+int haze_shard_run_worker (HazeShardConstructor construct_cm);
+
+G_END_DECLS
+
+#endif /* __HAZE_SHARD_H__ */
@@ -0,0 +1,406 @@
+/*
+ * state.c - haze's persistent libpurple state directory
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "config.h"
+
+#include "state.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include <telepathy-glib/util.h>
+
+#include "debug.h"
+#include "util.h"
+
+/* By default, libpurple's user_dir is a temporary directory which is thrown
+ * away on exit.  If HAZE_STATE_DIR is set, it is used instead and kept, so
+ * that the buddy list, buddy icon cache and preferences survive a restart.
+ *
+ * Only one haze process may use a given state directory at a time; this is
+ * enforced with a lock on LOCK_FILE.  VERSION_FILE records the layout of the
+ * directory: if it does not match STATE_VERSION, the contents are discarded
+ * rather than risking confusing libpurple with stale data.
+ */
+#define LOCK_FILE "lock"
+#define VERSION_FILE "version"
+#define STATE_VERSION "1"
+
+/* libpurple's own delay between a change to the buddy list and saving it */
+#define BLIST_SAVE_DELAY 5
+
+/* Whether each account publishes its presence to each contact; see
+ * haze_state_get_publish_store(). */
+#define PUBLISH_FILE "publish.ini"
+
+static gchar *state_dir = NULL;
+static gint lock_fd = -1;
+static gboolean warm = FALSE;
+
+static GKeyFile *publish_store = NULL;
+static guint publish_save_id = 0;
+
+static guint blist_changes_dropped = 0;
+static guint blist_saves_avoided = 0;
+static gint64 blist_save_due = 0;
+
+static gboolean
+take_lock (const gchar *dir)
+{
+    gchar *path = g_build_filename (dir, LOCK_FILE, NULL);
+    struct flock lock = { 0, };
+    gint fd;
+
+    fd = g_open (path, O_RDWR | O_CREAT, 0600);
+
+    if (fd < 0)
+    {
+        g_warning ("couldn't open %s: %s", path, g_strerror (errno));
+        g_free (path);
+        return FALSE;
+    }
+
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+
+    if (fcntl (fd, F_SETLK, &lock) < 0)
+    {
+        g_warning ("%s is in use by another process; not using it", dir);
+        close (fd);
+        g_free (path);
+        return FALSE;
+    }
+
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+    lock_fd = fd;
+    g_free (path);
+    return TRUE;
+}
+
+static void
+wipe_state (const gchar *dir)
+{
+    GDir *d = g_dir_open (dir, 0, NULL);
+    const gchar *name;
+
+    if (d == NULL)
+        return;
+
+    while ((name = g_dir_read_name (d)) != NULL)
+    {
+        gchar *path;
+
+        if (!tp_strdiff (name, LOCK_FILE))
+            continue;
+
+        path = g_build_filename (dir, name, NULL);
+
+        if (g_file_test (path, G_FILE_TEST_IS_DIR))
+        {
+            if (!haze_remove_directory (path))
+                g_warning ("couldn't delete %s", path);
+        }
+        else if (g_unlink (path) != 0)
+        {
+            g_warning ("couldn't delete %s: %s", path, g_strerror (errno));
+        }
+
+        g_free (path);
+    }
+
+    g_dir_close (d);
+}
+
+static gboolean
+check_version (const gchar *dir)
+{
+    gchar *path = g_build_filename (dir, VERSION_FILE, NULL);
+    gchar *contents = NULL;
+    gboolean ret = TRUE;
+    GError *error = NULL;
+
+    if (g_file_get_contents (path, &contents, NULL, NULL) &&
+        !tp_strdiff (g_strchomp (contents), STATE_VERSION))
+        goto out;
+
+    if (contents != NULL)
+        DEBUG ("discarding state in %s with version '%s'", dir, contents);
+
+    wipe_state (dir);
+
+    if (!g_file_set_contents (path, STATE_VERSION "\n", -1, &error))
+    {
+        g_warning ("couldn't write %s: %s", path, error->message);
+        g_error_free (error);
+        ret = FALSE;
+    }
+
+out:
+    g_free (contents);
+    g_free (path);
+    return ret;
+}
+
+/**
+ * haze_state_dir_open:
+ *
+ * Locks and returns the persistent state directory named by HAZE_STATE_DIR,
+ * creating it if necessary.
+ *
+ * Returns: the directory, owned by this module until haze_state_dir_close(),
+ *          or %NULL if persistent state is not enabled or the directory is
+ *          unusable, in which case a temporary directory should be used.
+ */
+const gchar *
+haze_state_dir_open (void)
+{
+    const gchar *dir = g_getenv ("HAZE_STATE_DIR");
+    gchar *blist;
+
+    g_return_val_if_fail (state_dir == NULL, state_dir);
+
+    if (dir == NULL || *dir == '\0')
+        return NULL;
+
+    if (g_mkdir_with_parents (dir, 0700) != 0)
+    {
+        g_warning ("couldn't create %s: %s", dir, g_strerror (errno));
+        return NULL;
+    }
+
+    if (!take_lock (dir))
+        return NULL;
+
+    if (!check_version (dir))
+    {
+        haze_state_dir_close ();
+        return NULL;
+    }
+
+    blist = g_build_filename (dir, "blist.xml", NULL);
+    warm = g_file_test (blist, G_FILE_TEST_EXISTS);
+    g_free (blist);
+
+    state_dir = g_strdup (dir);
+    DEBUG ("using %s state in %s", warm ? "warm" : "cold", state_dir);
+
+    return state_dir;
+}
+
+gboolean
+haze_state_dir_is_persistent (void)
+{
+    return (state_dir != NULL);
+}
+
+/* Returns TRUE if the state directory held a buddy list from a previous run. */
+gboolean
+haze_state_dir_is_warm (void)
+{
+    return warm;
+}
+
+static void publish_store_save (void);
+
+void
+haze_state_dir_close (void)
+{
+    if (publish_save_id != 0)
+    {
+        g_source_remove (publish_save_id);
+        publish_save_id = 0;
+        publish_store_save ();
+    }
+
+    if (publish_store != NULL)
+    {
+        g_key_file_free (publish_store);
+        publish_store = NULL;
+    }
+
+    if (blist_changes_dropped > 0)
+        DEBUG ("avoided %u buddy list saves, covering %u changes",
+            blist_saves_avoided, blist_changes_dropped);
+
+    if (lock_fd >= 0)
+    {
+        close (lock_fd);
+        lock_fd = -1;
+    }
+
+    g_free (state_dir);
+    state_dir = NULL;
+    warm = FALSE;
+}
+
+/**
+ * haze_state_get_publish_store:
+ *
+ * libpurple only knows whether an account publishes its presence to a
+ * contact while it is asking the user; this store lets the contact list
+ * remember the answers, and any unanswered requests, across connections
+ * and restarts. It is read from the state directory the first time it is
+ * needed, and is shared by every account in the process; call
+ * haze_state_publish_store_changed() after changing it.
+ *
+ * Returns: the store, owned by this module, or %NULL if persistent state is
+ *          not enabled.
+ */
+GKeyFile *
+haze_state_get_publish_store (void)
+{
+    GError *error = NULL;
+    gchar *path;
+
+    if (state_dir == NULL)
+        return NULL;
+
+    if (publish_store != NULL)
+        return publish_store;
+
+    publish_store = g_key_file_new ();
+    path = g_build_filename (state_dir, PUBLISH_FILE, NULL);
+
+    if (!g_key_file_load_from_file (publish_store, path, G_KEY_FILE_NONE,
+            &error))
+    {
+        if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_warning ("couldn't load %s: %s", path, error->message);
+
+        g_clear_error (&error);
+    }
+
+    g_free (path);
+    return publish_store;
+}
+
+static void
+publish_store_save (void)
+{
+    GError *error = NULL;
+    gchar *path, *data;
+    gsize len;
+
+    g_return_if_fail (state_dir != NULL && publish_store != NULL);
+
+    path = g_build_filename (state_dir, PUBLISH_FILE, NULL);
+    data = g_key_file_to_data (publish_store, &len, NULL);
+
+    if (!g_file_set_contents (path, data, len, &error))
+    {
+        g_warning ("couldn't save %s: %s", path, error->message);
+        g_error_free (error);
+    }
+
+    g_free (data);
+    g_free (path);
+}
+
+static gboolean
+publish_save_cb (gpointer data)
+{
+    publish_save_id = 0;
+    publish_store_save ();
+    return FALSE;
+}
+
+/* Saves the publish store after a delay, so that a burst of changes is
+ * saved once. */
+void
+haze_state_publish_store_changed (void)
+{
+    if (publish_store == NULL || publish_save_id != 0)
+        return;
+
+    publish_save_id = g_timeout_add_seconds (BLIST_SAVE_DELAY,
+        publish_save_cb, NULL);
+}
+
+/* libpurple regenerates and rewrites the whole of blist.xml a few seconds
+ * after any change to the buddy list.  When the user_dir is a temporary
+ * directory nothing will ever read it back, so the save UI ops drop the
+ * changes instead, counting the saves that libpurple would have made.
+ */
+static void
+drop_blist_change (void)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    blist_changes_dropped++;
+
+    if (now >= blist_save_due)
+    {
+        blist_saves_avoided++;
+        blist_save_due = now + BLIST_SAVE_DELAY * G_USEC_PER_SEC;
+    }
+}
+
+static void
+blist_save_node (PurpleBlistNode *node)
+{
+    drop_blist_change ();
+}
+
+static void
+blist_save_account (PurpleAccount *account)
+{
+    drop_blist_change ();
+}
+
+static PurpleBlistUiOps blist_ui_ops =
+{
+    NULL, /* new_list */
+    NULL, /* new_node */
+    NULL, /* show */
+    NULL, /* update */
+    NULL, /* remove */
+    NULL, /* destroy */
+    NULL, /* set_visible */
+    NULL, /* request_add_buddy */
+    NULL, /* request_add_chat */
+    NULL, /* request_add_group */
+    blist_save_node,
+    blist_save_node, /* remove_node */
+    blist_save_account,
+
+    /* padding */
+    NULL
+};
+
+/**
+ * haze_state_get_blist_ui_ops:
+ *
+ * Returns: buddy list UI ops which stop libpurple from saving the buddy list,
+ *          or %NULL if it is being kept in a persistent state directory and
+ *          so should be saved as normal.
+ */
+PurpleBlistUiOps *
+haze_state_get_blist_ui_ops (void)
+{
+    if (haze_state_dir_is_persistent ())
+        return NULL;
+
+    return &blist_ui_ops;
+}
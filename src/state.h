@@ -0,0 +1,45 @@
+#ifndef __HAZE_STATE_H__
+#define __HAZE_STATE_H__
+/*
+ * state.h - header for haze's persistent libpurple state directory
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib.h>
+
+#include <libpurple/blist.h>
+
+G_BEGIN_DECLS
+
+const gchar *haze_state_dir_open (void);
+
+gboolean haze_state_dir_is_persistent (void);
+
+gboolean haze_state_dir_is_warm (void);
+
+void haze_state_dir_close (void);
+
+PurpleBlistUiOps *haze_state_get_blist_ui_ops (void);
+
+GKeyFile *haze_state_get_publish_store (void);
+
+void haze_state_publish_store_changed (void);
+
+G_END_DECLS
+
+#endif /* __HAZE_STATE_H__ */
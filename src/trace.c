@@ -0,0 +1,181 @@
+/*
+ * trace.c - haze's startup tracing
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "config.h"
+
+#include "trace.h"
+
+#include <unistd.h>
+
+#include "debug.h"
+
+/* If HAZE_TRACE is set to a filename, the start and end of each phase of
+ * startup are recorded, and written to that file once the connection manager
+ * is on the bus.  The file is in the Trace Event Format understood by
+ * Chromium's about:tracing and similar tools.
+ */
+
+static gchar *trace_file = NULL;
+/* The events recorded so far, as comma-separated JSON objects */
+static GString *events = NULL;
+
+/* The plugin being probed, and when probing it started */
+static gchar *probe_plugin = NULL;
+static gint64 probe_started = 0;
+
+static void
+append_json_string (GString *str,
+                    const gchar *s)
+{
+    g_string_append_c (str, '"');
+
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            g_string_append_printf (str, "\\%c", *s);
+        else if ((guchar) *s < 0x20)
+            g_string_append_printf (str, "\\u%04x", (guchar) *s);
+        else
+            g_string_append_c (str, *s);
+    }
+
+    g_string_append_c (str, '"');
+}
+
+static void
+add_event (const gchar *name,
+           const gchar *phase_type,
+           gint64 timestamp,
+           gint64 duration)
+{
+    if (events->len > 0)
+        g_string_append (events, ",\n");
+
+    g_string_append (events, "{\"name\":");
+    append_json_string (events, name);
+    g_string_append_printf (events,
+        ",\"cat\":\"startup\",\"ph\":\"%s\",\"ts\":%" G_GINT64_FORMAT
+        ",\"pid\":%d,\"tid\":1", phase_type, timestamp, (int) getpid ());
+
+    if (duration >= 0)
+        g_string_append_printf (events, ",\"dur\":%" G_GINT64_FORMAT,
+            duration);
+
+    g_string_append_c (events, '}');
+}
+
+void
+haze_trace_init (void)
+{
+    const gchar *env = g_getenv ("HAZE_TRACE");
+
+    if (env == NULL || *env == '\0')
+        return;
+
+    trace_file = g_strdup (env);
+    events = g_string_new (NULL);
+
+    haze_trace_begin ("startup");
+}
+
+gboolean
+haze_trace_is_enabled (void)
+{
+    return (events != NULL);
+}
+
+void
+haze_trace_begin (const gchar *phase)
+{
+    if (events != NULL)
+        add_event (phase, "B", g_get_monotonic_time (), -1);
+}
+
+void
+haze_trace_end (const gchar *phase)
+{
+    if (events != NULL)
+        add_event (phase, "E", g_get_monotonic_time (), -1);
+}
+
+/**
+ * haze_trace_probe:
+ * @plugin: the plugin libpurple has started to probe, or %NULL once probing
+ *          has finished
+ *
+ * libpurple doesn't say when it has finished probing a plugin, so each
+ * plugin's probe is taken to last until the next one starts.
+ */
+void
+haze_trace_probe (const gchar *plugin)
+{
+    gint64 now;
+
+    if (events == NULL)
+        return;
+
+    now = g_get_monotonic_time ();
+
+    if (probe_plugin != NULL)
+    {
+        add_event (probe_plugin, "X", probe_started, now - probe_started);
+        g_free (probe_plugin);
+        probe_plugin = NULL;
+    }
+
+    if (plugin != NULL)
+    {
+        probe_plugin = g_path_get_basename (plugin);
+        probe_started = now;
+    }
+}
+
+/* Writes out the trace, and stops tracing. */
+void
+haze_trace_finish (void)
+{
+    GError *error = NULL;
+    gchar *contents;
+
+    if (events == NULL)
+        return;
+
+    haze_trace_probe (NULL);
+    haze_trace_end ("startup");
+
+    contents = g_strdup_printf ("{\"traceEvents\":[\n%s\n]}\n", events->str);
+
+    if (!g_file_set_contents (trace_file, contents, -1, &error))
+    {
+        g_warning ("couldn't write trace to %s: %s", trace_file,
+            error->message);
+        g_error_free (error);
+    }
+    else
+    {
+        DEBUG ("wrote startup trace to %s", trace_file);
+    }
+
+    g_free (contents);
+    g_string_free (events, TRUE);
+    events = NULL;
+    g_free (trace_file);
+    trace_file = NULL;
+}
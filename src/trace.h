@@ -0,0 +1,41 @@
+#ifndef __HAZE_TRACE_H__
+#define __HAZE_TRACE_H__
+/*
+ * trace.h - header for haze's startup tracing
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void haze_trace_init (void);
+
+gboolean haze_trace_is_enabled (void);
+
+void haze_trace_begin (const gchar *phase);
+
+void haze_trace_end (const gchar *phase);
+
+void haze_trace_probe (const gchar *plugin);
+
+void haze_trace_finish (void);
+
+G_END_DECLS
+
+#endif /* __HAZE_TRACE_H__ */
@@ -0,0 +1,301 @@
+/*
+ * watchdog.c - haze's main loop stall watchdog
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "config.h"
+
+#include "watchdog.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib-unix.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include <telepathy-glib/dbus.h>
+#include <telepathy-glib/proxy.h>
+
+/* Every account in the process shares one main loop, so one slow callback
+ * delays all of them.  If HAZE_STALL_THRESHOLD is set to a number of
+ * milliseconds, the time spent between one poll() and the next (that is, in
+ * preparing, checking and dispatching sources) is measured, and any main loop
+ * iteration which takes longer than the threshold is reported together with
+ * the slowest callback it ran.
+ *
+ * Callbacks are identified by the event loop for libpurple's input watches
+ * and timers, and by a D-Bus filter for incoming method calls; anything else
+ * is reported as unknown.  A histogram of iteration times is logged on exit
+ * and on SIGUSR1.
+ */
+
+/* Bucket i counts iterations taking less than 2^i ms, and more than the
+ * previous bucket's limit; the last bucket counts everything longer. */
+#define N_BUCKETS 16
+
+typedef struct _HazeWatchdogSpan HazeWatchdogSpan;
+struct _HazeWatchdogSpan {
+    const gchar *kind;
+    gconstpointer function;
+    gint fd;
+    /* The D-Bus method name, if any */
+    gchar method[64];
+
+    gint64 started;
+    gint64 duration;
+};
+
+static gboolean enabled = FALSE;
+static gint64 threshold = 0;
+static GPollFunc real_poll = NULL;
+
+/* When the current iteration's poll() returned, or 0 */
+static gint64 iteration_started = 0;
+static guint64 histogram[N_BUCKETS];
+static guint64 stalls = 0;
+
+/* The callback which is running, if span.started is non-zero, and the
+ * slowest callback so far in this iteration */
+static HazeWatchdogSpan span;
+static HazeWatchdogSpan slowest;
+
+static DBusConnection *bus_connection = NULL;
+
+static void
+span_close (gint64 now)
+{
+    if (span.started == 0)
+        return;
+
+    span.duration = now - span.started;
+
+    if (span.duration > slowest.duration)
+        slowest = span;
+
+    span.started = 0;
+}
+
+static void
+span_open (const gchar *kind,
+           gconstpointer function,
+           gint fd,
+           const gchar *method)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    span_close (now);
+
+    span.kind = kind;
+    span.function = function;
+    span.fd = fd;
+    g_strlcpy (span.method, method != NULL ? method : "",
+        sizeof (span.method));
+    span.started = now;
+}
+
+static void
+report_stall (gint64 duration)
+{
+    stalls++;
+
+    if (slowest.kind == NULL)
+    {
+        g_message ("main loop stalled for %" G_GINT64_FORMAT " ms in an "
+            "unknown callback", duration / 1000);
+    }
+    else if (slowest.method[0] != '\0')
+    {
+        g_message ("main loop stalled for %" G_GINT64_FORMAT " ms; "
+            "%s %s took %" G_GINT64_FORMAT " ms", duration / 1000,
+            slowest.kind, slowest.method, slowest.duration / 1000);
+    }
+    else
+    {
+        g_message ("main loop stalled for %" G_GINT64_FORMAT " ms; "
+            "%s callback %p (fd %d) took %" G_GINT64_FORMAT " ms",
+            duration / 1000, slowest.kind, slowest.function, slowest.fd,
+            slowest.duration / 1000);
+    }
+}
+
+static void
+iteration_end (gint64 now)
+{
+    gint64 duration;
+    guint64 ms;
+    guint bucket = 0;
+
+    if (iteration_started == 0)
+        return;
+
+    span_close (now);
+
+    duration = now - iteration_started;
+
+    for (ms = duration / 1000; ms > 0 && bucket < N_BUCKETS - 1; ms >>= 1)
+        bucket++;
+
+    histogram[bucket]++;
+
+    if (duration >= threshold)
+        report_stall (duration);
+
+    memset (&slowest, 0, sizeof (slowest));
+    iteration_started = 0;
+}
+
+static gint
+watchdog_poll (GPollFD *fds,
+               guint nfds,
+               gint timeout)
+{
+    gint ret;
+
+    iteration_end (g_get_monotonic_time ());
+    ret = real_poll (fds, nfds, timeout);
+    iteration_started = g_get_monotonic_time ();
+
+    return ret;
+}
+
+static void
+dump_histogram (void)
+{
+    GString *str = g_string_new ("main loop iteration times:");
+    guint i;
+
+    for (i = 0; i < N_BUCKETS; i++)
+    {
+        if (histogram[i] == 0)
+            continue;
+
+        if (i == N_BUCKETS - 1)
+            g_string_append_printf (str, " >=%u ms: %" G_GUINT64_FORMAT ";",
+                1 << (i - 1), histogram[i]);
+        else
+            g_string_append_printf (str, " <%u ms: %" G_GUINT64_FORMAT ";",
+                1 << i, histogram[i]);
+    }
+
+    g_message ("%s %" G_GUINT64_FORMAT " stalls", str->str, stalls);
+    g_string_free (str, TRUE);
+}
+
+static gboolean
+sigusr1_cb (gpointer data)
+{
+    dump_histogram ();
+    return TRUE;
+}
+
+void
+haze_watchdog_init (void)
+{
+    const gchar *env = g_getenv ("HAZE_STALL_THRESHOLD");
+
+    if (env == NULL || *env == '\0')
+        return;
+
+    threshold = strtoul (env, NULL, 10) * 1000;
+    enabled = TRUE;
+
+    real_poll = g_main_context_get_poll_func (NULL);
+    g_main_context_set_poll_func (NULL, watchdog_poll);
+
+    g_unix_signal_add (SIGUSR1, sigusr1_cb, NULL);
+}
+
+static DBusHandlerResult
+bus_filter (DBusConnection *connection,
+            DBusMessage *message,
+            void *data)
+{
+    /* The handler runs after the filters, so this span lasts until the next
+     * one starts or the main loop polls again. */
+    if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+        span_open ("D-Bus method", NULL, -1, dbus_message_get_member (message));
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Starts attributing time to incoming D-Bus method calls. Must be called
+ * once the connection manager has connected to the bus. */
+void
+haze_watchdog_watch_bus (void)
+{
+    TpDBusDaemon *bus;
+
+    if (!enabled || bus_connection != NULL)
+        return;
+
+    bus = tp_dbus_daemon_dup (NULL);
+
+    if (bus == NULL)
+        return;
+
+    bus_connection = dbus_connection_ref (dbus_g_connection_get_connection (
+        tp_proxy_get_dbus_connection (bus)));
+    dbus_connection_add_filter (bus_connection, bus_filter, NULL, NULL);
+
+    g_object_unref (bus);
+}
+
+/**
+ * haze_watchdog_begin:
+ * @kind: what sort of callback is about to run
+ * @function: the callback
+ * @fd: the file descriptor the callback is for, or -1
+ *
+ * Attributes the time until haze_watchdog_end() to @function.
+ */
+void
+haze_watchdog_begin (const gchar *kind,
+                     gconstpointer function,
+                     gint fd)
+{
+    if (enabled)
+        span_open (kind, function, fd, NULL);
+}
+
+void
+haze_watchdog_end (void)
+{
+    if (enabled)
+        span_close (g_get_monotonic_time ());
+}
+
+void
+haze_watchdog_uninit (void)
+{
+    if (!enabled)
+        return;
+
+    dump_histogram ();
+
+    if (bus_connection != NULL)
+    {
+        dbus_connection_remove_filter (bus_connection, bus_filter, NULL);
+        dbus_connection_unref (bus_connection);
+        bus_connection = NULL;
+    }
+
+    g_main_context_set_poll_func (NULL, real_poll);
+    enabled = FALSE;
+}
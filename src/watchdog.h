@@ -0,0 +1,41 @@
+#ifndef __HAZE_WATCHDOG_H__
+#define __HAZE_WATCHDOG_H__
+/*
+ * watchdog.h - header for haze's main loop stall watchdog
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void haze_watchdog_init (void);
+
+void haze_watchdog_watch_bus (void);
+
+void haze_watchdog_begin (const gchar *kind,
+    gconstpointer function,
+    gint fd);
+
+void haze_watchdog_end (void);
+
+void haze_watchdog_uninit (void);
+
+G_END_DECLS
+
+#endif /* __HAZE_WATCHDOG_H__ */
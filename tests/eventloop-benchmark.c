@@ -0,0 +1,265 @@
+/*
+ * eventloop-benchmark.c - compare haze's event loop with a GSource per watch
+ * Copyright (C) 2026 Collabora Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/* Usage: eventloop-benchmark [SOCKETS [ROUNDS]]
+ *
+ * Opens SOCKETS socket pairs, and for each event loop implementation times:
+ *
+ *  - churn: removing and re-adding a read watch on every socket, as prpls
+ *    do when they re-arm their watches, ROUNDS times;
+ *  - dispatch: ROUNDS main loop iterations with a read watch on every socket
+ *    and one socket readable, which shows the cost of scanning every watch.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "src/eventloop.h"
+
+/* The implementation haze used before src/eventloop.c, copied from
+ * nullclient. */
+#define PURPLE_GLIB_READ_COND  (G_IO_IN | G_IO_HUP | G_IO_ERR)
+#define PURPLE_GLIB_WRITE_COND (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+typedef struct _PurpleGLibIOClosure {
+    PurpleInputFunction function;
+    guint result;
+    gpointer data;
+} PurpleGLibIOClosure;
+
+static void purple_glib_io_destroy(gpointer data)
+{
+    g_free(data);
+}
+
+static gboolean purple_glib_io_invoke(GIOChannel *source,
+                                      GIOCondition condition,
+                                      gpointer data)
+{
+    PurpleGLibIOClosure *closure = data;
+    PurpleInputCondition purple_cond = 0;
+
+    if (condition & PURPLE_GLIB_READ_COND)
+        purple_cond |= PURPLE_INPUT_READ;
+    if (condition & PURPLE_GLIB_WRITE_COND)
+        purple_cond |= PURPLE_INPUT_WRITE;
+
+    closure->function(closure->data, g_io_channel_unix_get_fd(source),
+                      purple_cond);
+
+    return TRUE;
+}
+
+static guint glib_input_add(gint fd,
+                            PurpleInputCondition condition,
+                            PurpleInputFunction function,
+                            gpointer data)
+{
+    PurpleGLibIOClosure *closure = g_new0(PurpleGLibIOClosure, 1);
+    GIOChannel *channel;
+    GIOCondition cond = 0;
+
+    closure->function = function;
+    closure->data = data;
+
+    if (condition & PURPLE_INPUT_READ)
+        cond |= PURPLE_GLIB_READ_COND;
+    if (condition & PURPLE_INPUT_WRITE)
+        cond |= PURPLE_GLIB_WRITE_COND;
+
+    channel = g_io_channel_unix_new(fd);
+    closure->result = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond,
+            purple_glib_io_invoke, closure, purple_glib_io_destroy);
+
+    g_io_channel_unref(channel);
+    return closure->result;
+}
+
+static PurpleEventLoopUiOps glib_eventloops =
+{
+    g_timeout_add,
+    g_source_remove,
+    glib_input_add,
+    g_source_remove,
+    NULL,
+
+    /* padding */
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+/*** End of the eventloop functions. ***/
+
+static guint n_sockets = 200;
+static guint n_rounds = 1000;
+
+/* Each pair's first fd is watched; writing to the second makes it readable */
+static gint (*pairs)[2] = NULL;
+static guint *handles = NULL;
+static guint n_dispatched = 0;
+
+static void
+input_cb (gpointer data,
+          gint fd,
+          PurpleInputCondition condition)
+{
+    n_dispatched++;
+}
+
+static void
+add_watches (PurpleEventLoopUiOps *ops)
+{
+    guint i;
+
+    for (i = 0; i < n_sockets; i++)
+        handles[i] = ops->input_add (pairs[i][0], PURPLE_INPUT_READ, input_cb,
+            NULL);
+}
+
+static void
+remove_watches (PurpleEventLoopUiOps *ops)
+{
+    guint i;
+
+    for (i = 0; i < n_sockets; i++)
+        ops->input_remove (handles[i]);
+}
+
+static gdouble
+time_churn (PurpleEventLoopUiOps *ops)
+{
+    gint64 start;
+    guint round, i;
+
+    add_watches (ops);
+    start = g_get_monotonic_time ();
+
+    for (round = 0; round < n_rounds; round++)
+    {
+        for (i = 0; i < n_sockets; i++)
+        {
+            ops->input_remove (handles[i]);
+            handles[i] = ops->input_add (pairs[i][0], PURPLE_INPUT_READ,
+                input_cb, NULL);
+        }
+    }
+
+    start = g_get_monotonic_time () - start;
+    remove_watches (ops);
+
+    return (gdouble) start / (n_rounds * n_sockets);
+}
+
+static gdouble
+time_dispatch (PurpleEventLoopUiOps *ops)
+{
+    gint64 start;
+    guint round;
+
+    add_watches (ops);
+
+    /* Nothing ever reads it, so it stays readable */
+    if (write (pairs[0][1], "x", 1) != 1)
+        g_error ("couldn't write to socket");
+
+    n_dispatched = 0;
+    start = g_get_monotonic_time ();
+
+    for (round = 0; round < n_rounds; round++)
+        g_main_context_iteration (NULL, FALSE);
+
+    start = g_get_monotonic_time () - start;
+
+    if (n_dispatched != n_rounds)
+        g_error ("expected %u callbacks, got %u", n_rounds, n_dispatched);
+
+    remove_watches (ops);
+
+    /* Start the next run with nothing readable */
+    close (pairs[0][0]);
+    close (pairs[0][1]);
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, pairs[0]) != 0)
+        g_error ("couldn't replace socket pair");
+
+    return (gdouble) start / n_rounds;
+}
+
+static void
+run (const gchar *name,
+     PurpleEventLoopUiOps *ops)
+{
+    gdouble churn = time_churn (ops);
+    gdouble dispatch = time_dispatch (ops);
+
+    g_print ("%-10s churn: %8.3f us/watch   dispatch: %8.3f us/iteration\n",
+        name, churn, dispatch);
+}
+
+int
+main (int argc,
+      char **argv)
+{
+    guint i;
+
+    if (argc > 1)
+        n_sockets = strtoul (argv[1], NULL, 10);
+
+    if (argc > 2)
+        n_rounds = strtoul (argv[2], NULL, 10);
+
+    if (n_sockets == 0 || n_rounds == 0)
+    {
+        g_printerr ("Usage: %s [SOCKETS [ROUNDS]]\n", argv[0]);
+        return 2;
+    }
+
+    pairs = g_new0 (gint[2], n_sockets);
+    handles = g_new0 (guint, n_sockets);
+
+    for (i = 0; i < n_sockets; i++)
+    {
+        if (socketpair (AF_UNIX, SOCK_STREAM, 0, pairs[i]) != 0)
+            g_error ("couldn't create socket pair %u (raise ulimit -n?)", i);
+    }
+
+    g_print ("%u sockets, %u rounds\n", n_sockets, n_rounds);
+    run ("GSource", &glib_eventloops);
+    run ("haze", haze_eventloop_get_ui_ops ());
+
+    haze_eventloop_uninit ();
+
+    for (i = 0; i < n_sockets; i++)
+    {
+        close (pairs[i][0]);
+        close (pairs[i][1]);
+    }
+
+    g_free (pairs);
+    g_free (handles);
+
+    return 0;
+}
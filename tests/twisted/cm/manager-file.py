@@ -0,0 +1,126 @@
+"""
+Test that the .manager file agrees with the running connection manager.
+"""
+
+import os
+import shutil
+import subprocess
+import tempfile
+import ConfigParser
+from StringIO import StringIO
+
+import dbus
+
+import constants as cs
+from servicetest import assertEquals, tp_path_prefix
+from hazetest import exec_test
+
+def unescape(value):
+    ret = ''
+    i = 0
+
+    while i < len(value):
+        if value[i] == '\\' and i + 1 < len(value):
+            ret += { 's': ' ', 'n': '\n', 't': '\t', 'r': '\r',
+                '\\': '\\' }.get(value[i + 1], value[i + 1])
+            i += 2
+        else:
+            ret += value[i]
+            i += 1
+
+    return ret
+
+def parse_default(sig, value):
+    if sig == 's':
+        return unescape(value)
+    elif sig == 'b':
+        return value in ('true', '1')
+    elif sig in ('i', 'n', 'u', 'q'):
+        return int(value)
+    else:
+        assert False, "unexpected parameter type %s" % sig
+
+def params_from_file(manager, group):
+    params = {}
+
+    for key, value in manager.items(group):
+        if not key.startswith('param-'):
+            continue
+
+        name = key[len('param-'):]
+        words = value.split()
+        sig = words[0]
+        flags = 0
+
+        if 'required' in words:
+            flags |= cs.PARAM_REQUIRED
+        if 'register' in words:
+            flags |= cs.PARAM_REGISTER
+        if 'secret' in words:
+            flags |= cs.PARAM_SECRET
+
+        if manager.has_option(group, 'default-' + name):
+            flags |= cs.PARAM_HAS_DEFAULT
+            default = parse_default(sig,
+                    manager.get(group, 'default-' + name))
+        else:
+            default = None
+
+        params[name] = (flags, sig, default)
+
+    return params
+
+def test(q, bus, conn, stream):
+    builddir = os.environ['HAZE_ABS_TOP_BUILDDIR']
+
+    # The manager file is generated at build time, so it mustn't touch the
+    # developer's state directory.
+    tmp = tempfile.mkdtemp()
+    state_dir = os.path.join(tmp, 'state')
+    env = dict(os.environ)
+    env['HAZE_STATE_DIR'] = state_dir
+
+    try:
+        output = subprocess.Popen(
+                [os.path.join(builddir, 'src', 'telepathy-haze'),
+                    '--print-manager-file'],
+                stdout=subprocess.PIPE, env=env).communicate()[0]
+        assert not os.path.exists(state_dir), state_dir
+    finally:
+        shutil.rmtree(tmp)
+
+    manager = ConfigParser.RawConfigParser()
+    # Keys in .manager files are case-sensitive
+    manager.optionxform = str
+    manager.readfp(StringIO(output))
+
+    cm = bus.get_object(cs.CM + '.haze',
+        tp_path_prefix + '/ConnectionManager/haze')
+    cm_iface = dbus.Interface(cm, cs.CM)
+
+    protocol_names = cm_iface.ListProtocols()
+    assertEquals(sorted(protocol_names),
+        sorted([s[len('Protocol '):] for s in manager.sections()
+            if s.startswith('Protocol ')]))
+
+    for name in protocol_names:
+        expected = params_from_file(manager, 'Protocol ' + name)
+        actual = {}
+
+        for p_name, flags, sig, default in cm_iface.GetParameters(name):
+            # .manager files have no way to express this flag
+            flags &= ~cs.PARAM_DBUS_PROPERTY
+
+            if not flags & cs.PARAM_HAS_DEFAULT:
+                default = None
+
+            actual[str(p_name)] = (flags, str(sig), default)
+
+        assertEquals((name, expected), (name, actual))
+
+if __name__ == '__main__':
+    if 'HAZE_ABS_TOP_BUILDDIR' not in os.environ:
+        print "SKIP: the manager file can only be checked uninstalled"
+        raise SystemExit(77)
+
+    exec_test(test)
@@ -0,0 +1,29 @@
+"""
+Test that with HAZE_SHARDS set, connections are made by a worker process
+rather than the one which owns the connection manager's name.
+"""
+
+from servicetest import assertNotEquals
+from hazetest import exec_test, set_haze_environment
+import constants as cs
+
+def test(q, bus, conn, stream):
+    cm_owner = bus.get_name_owner(cs.CM + '.haze')
+    conn_owner = bus.get_name_owner(conn.object.requested_bus_name)
+    assertNotEquals(cm_owner, conn_owner)
+
+    # The worker's connection works like any other
+    conn.Connect()
+    q.expect('dbus-signal', signal='StatusChanged',
+        args=[cs.CONN_STATUS_CONNECTING, cs.CSR_REQUESTED])
+    q.expect('stream-authenticated')
+    q.expect('dbus-signal', signal='StatusChanged',
+        args=[cs.CONN_STATUS_CONNECTED, cs.CSR_REQUESTED])
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged',
+        args=[cs.CONN_STATUS_DISCONNECTED, cs.CSR_REQUESTED])
+
+if __name__ == '__main__':
+    set_haze_environment(HAZE_SHARDS='2')
+    exec_test(test, do_connect=False)
@@ -193,6 +193,8 @@ CONN_IFACE_CLIENT_TYPES = CONN + '.Interface.ClientTypes'
 CONN_IFACE_POWER_SAVING = CONN + '.Interface.PowerSaving'
 CONN_IFACE_CONTACT_BLOCKING = CONN + '.Interface.ContactBlocking'
 CONN_IFACE_ADDRESSING = CONN + '.Interface.Addressing1'
+CONN_IFACE_CONTACT_LIST_CHANGES = \
+    CONN + '.Interface.ContactListChanges.DRAFT'
 
 ATTR_CONTACT_CAPABILITIES = CONN_IFACE_CONTACT_CAPS + '/capabilities'
 ATTR_PRESENCE = CONN_IFACE_SIMPLE_PRESENCE + '/presence'
@@ -540,3 +542,6 @@ ROOM_SERVER = CHANNEL_IFACE_ROOM + '.Server'
 SUBJECT = CHANNEL_IFACE_ROOM + '.Subject'
 SUBJECT_PRESENT = 1
 SUBJECT_CAN_SET = 2
+
+DEBUG_IFACE = "org.freedesktop.Telepathy.Debug"
+DEBUG_PATH = "/org/freedesktop/Telepathy/debug"
@@ -67,6 +67,51 @@ def expect_kinda_connected(queue):
     queue.expect('dbus-signal', signal='StatusChanged',
         args=[cs.CONN_STATUS_CONNECTED, cs.CSR_REQUESTED])
 
+def make_another_connection(q, bus, protocol=EmptyRosterXmppXmlStream,
+        port=4243):
+    """Makes a new connection to the same account as exec_test()'s, served by
+    a new stream listening on @port, and returns it and its stream. The
+    connection isn't connected yet."""
+    stream = make_stream(q.append, protocol=protocol)
+    factory = StreamFactory([stream], ['test@localhost'])
+    reactor.listenTCP(port, factory, interface='localhost')
+
+    conn, jid = make_haze_connection(bus, q.append,
+        params={ 'port': dbus.UInt32(port) })
+    return (conn, stream)
+
+def wait_for_haze_to_exit(q, bus):
+    """Waits for Haze to exit, which it does a few seconds after its last
+    connection has gone away; the next connection made will start it again."""
+    if not bus.name_has_owner(cs.CM + '.haze'):
+        return
+
+    # tp_run_connection_manager() waits 5 seconds before exiting
+    timeout = q.timeout
+    q.timeout = max(timeout, 10)
+
+    try:
+        q.expect('dbus-signal', signal='NameOwnerChanged',
+            predicate=lambda e: e.args[0] == cs.CM + '.haze' and
+                e.args[2] == '')
+    finally:
+        q.timeout = timeout
+
+def set_haze_environment(**env):
+    """Sets environment variables for Haze. Haze is activated by the session
+    bus, so this only takes effect if it is called before exec_test()."""
+    bus = dbus.SessionBus()
+    bus_iface = dbus.Interface(
+        bus.get_object('org.freedesktop.DBus', '/org/freedesktop/DBus'),
+        'org.freedesktop.DBus')
+    bus_iface.UpdateActivationEnvironment(dbus.Dictionary(env, signature='ss'))
+
+def get_debug_messages(bus):
+    """Returns the text of the messages Haze's debug sender has kept."""
+    debug = bus.get_object(cs.CM + '.haze', cs.DEBUG_PATH)
+    messages = dbus.Interface(debug, cs.DEBUG_IFACE).GetMessages()
+    return [message for (timestamp, domain, level, message) in messages]
+
 # Copy pasta because we need to replace make_connection
 def exec_test(fun, params=None, protocol=EmptyRosterXmppXmlStream, timeout=None,
               authenticator=None, num_instances=1, do_connect=True):
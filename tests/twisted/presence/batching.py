@@ -0,0 +1,71 @@
+"""
+Test that presence changes arriving together are signalled together, and
+that the latest change for each contact wins. immediate.py reuses this to
+test that with HAZE_PRESENCE_DELAY=0, each is signalled at once.
+"""
+
+from twisted.words.xish import domish
+from twisted.words.protocols.jabber.client import IQ
+
+from servicetest import assertEquals
+from hazetest import exec_test
+import constants as cs
+
+CONTACTS = ['amy@foo.com', 'bob@foo.com', 'che@foo.com', 'dan@foo.com']
+
+def send_presence(stream, jid, show):
+    presence = domish.Element((None, 'presence'))
+    presence['from'] = jid
+    presence.addElement((None, 'show'), content=show)
+    stream.send(presence)
+
+def test(q, bus, conn, stream, immediate=False):
+    handles = dict(zip(CONTACTS, conn.RequestHandles(cs.HT_CONTACT, CONTACTS)))
+
+    iq = IQ(stream, 'set')
+    query = iq.addElement(('jabber:iq:roster', 'query'))
+
+    for jid in CONTACTS:
+        item = query.addElement('item')
+        item['jid'] = jid
+        item['subscription'] = 'both'
+
+    stream.send(iq)
+
+    # Everyone's presence arrives together, as it does after signing on.
+    for jid in CONTACTS:
+        send_presence(stream, jid, 'away')
+
+    expected = dict([(h, (3, 'away', '')) for h in handles.values()])
+
+    if immediate:
+        seen = {}
+
+        while len(seen) < len(CONTACTS):
+            event = q.expect('dbus-signal', signal='PresencesChanged')
+            assertEquals(1, len(event.args[0]))
+            seen.update(event.args[0])
+
+        assertEquals(expected, seen)
+    else:
+        event = q.expect('dbus-signal', signal='PresencesChanged')
+        assertEquals(expected, event.args[0])
+
+    # Amy changes their mind; unless each change is signalled at once, only
+    # the latest is.
+    amy_handle = handles['amy@foo.com']
+    send_presence(stream, 'amy@foo.com', 'xa')
+    send_presence(stream, 'amy@foo.com', 'dnd')
+
+    if immediate:
+        event = q.expect('dbus-signal', signal='PresencesChanged')
+        assertEquals({ amy_handle: (4, 'xa', '') }, event.args[0])
+
+    event = q.expect('dbus-signal', signal='PresencesChanged')
+    assertEquals({ amy_handle: (6, 'busy', '') }, event.args[0])
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,83 @@
+"""
+Test that, with HAZE_PRESENCE_DAMPING set, a contact signing off and straight
+back on isn't signalled, but a contact staying offline is.
+"""
+
+import time
+
+from twisted.words.xish import domish
+from twisted.words.protocols.jabber.client import IQ
+
+from servicetest import assertEquals, sync_dbus, EventPattern
+from hazetest import (exec_test, set_haze_environment, get_debug_messages,
+    sync_stream)
+import constants as cs
+
+DAMPING_MS = 500
+
+def send_presence(stream, type=None, status=None):
+    presence = domish.Element((None, 'presence'))
+    presence['from'] = 'amy@foo.com/Pub'
+
+    if type is not None:
+        presence['type'] = type
+
+    if status is not None:
+        presence.addElement((None, 'status'), content=status)
+
+    stream.send(presence)
+
+def test(q, bus, conn, stream):
+    amy_handle = conn.RequestHandles(1, ['amy@foo.com'])[0]
+
+    iq = IQ(stream, 'set')
+    query = iq.addElement(('jabber:iq:roster', 'query'))
+    item = query.addElement('item')
+    item['jid'] = 'amy@foo.com'
+    item['subscription'] = 'both'
+    stream.send(iq)
+
+    send_presence(stream, status='Here')
+    event = q.expect('dbus-signal', signal='PresencesChanged')
+    assertEquals({ amy_handle: (2, 'available', 'Here') }, event.args[0])
+
+    presence_changed = [EventPattern('dbus-signal', signal='PresencesChanged')]
+    q.forbid_events(presence_changed)
+
+    # Amy's connection is flaky.
+    send_presence(stream, type='unavailable')
+    send_presence(stream, status='Here')
+    send_presence(stream, type='unavailable')
+    send_presence(stream, status='Here')
+    sync_stream(q, stream)
+
+    # Until things calm down, Amy still looks online.
+    amy_handle, asv = conn.Contacts.GetContactByID('amy@foo.com',
+            [cs.CONN_IFACE_SIMPLE_PRESENCE])
+    assertEquals((2, 'available', 'Here'), asv.get(cs.ATTR_PRESENCE))
+
+    # Once they have, there's nothing to say, because Amy is back where
+    # things started.
+    time.sleep(2 * DAMPING_MS / 1000.0)
+    sync_dbus(bus, q, conn)
+
+    q.unforbid_events(presence_changed)
+
+    assert [m for m in get_debug_messages(bus)
+        if m.startswith('damped a presence change for handle %u'
+            % amy_handle)]
+
+    # Amy going offline for good is signalled, just not at once.
+    before = time.time()
+    send_presence(stream, type='unavailable')
+    event = q.expect('dbus-signal', signal='PresencesChanged')
+    assertEquals({ amy_handle: (1, 'offline', '') }, event.args[0])
+    assert time.time() - before >= DAMPING_MS / 1000.0, \
+        time.time() - before
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    set_haze_environment(HAZE_PRESENCE_DAMPING=str(DAMPING_MS))
+    exec_test(test)
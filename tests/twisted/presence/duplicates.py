@@ -0,0 +1,63 @@
+"""
+Test that libpurple reporting the same presence more than once doesn't cause
+more than one PresencesChanged signal.
+"""
+
+from twisted.words.xish import domish
+from twisted.words.protocols.jabber.client import IQ
+
+from servicetest import assertEquals, sync_dbus, EventPattern
+from hazetest import (exec_test, set_haze_environment, get_debug_messages,
+    sync_stream)
+import constants as cs
+
+def send_presence(stream, show, status):
+    presence = domish.Element((None, 'presence'))
+    presence['from'] = 'amy@foo.com'
+    presence.addElement((None, 'show'), content=show)
+    presence.addElement((None, 'status'), content=status)
+    stream.send(presence)
+
+def test(q, bus, conn, stream):
+    amy_handle = conn.RequestHandles(1, ['amy@foo.com'])[0]
+
+    iq = IQ(stream, 'set')
+    query = iq.addElement(('jabber:iq:roster', 'query'))
+    item = query.addElement('item')
+    item['jid'] = 'amy@foo.com'
+    item['subscription'] = 'both'
+    stream.send(iq)
+
+    # Amy signing on is reported as both a sign-on and a status change.
+    send_presence(stream, 'away', 'At the pub')
+    event = q.expect('dbus-signal', signal='PresencesChanged')
+    assertEquals({ amy_handle: (3, 'away', 'At the pub') }, event.args[0])
+
+    presence_changed = [EventPattern('dbus-signal', signal='PresencesChanged')]
+    q.forbid_events(presence_changed)
+
+    # The server repeating itself shouldn't be signalled either.
+    send_presence(stream, 'away', 'At the pub')
+    sync_stream(q, stream)
+    sync_dbus(bus, q, conn)
+
+    q.unforbid_events(presence_changed)
+
+    assert [m for m in get_debug_messages(bus)
+        if m.startswith('dropped a duplicate presence update for handle %u'
+            % amy_handle)]
+
+    # Genuine changes still get through.
+    send_presence(stream, 'dnd', 'Hiding from the barman')
+    event = q.expect('dbus-signal', signal='PresencesChanged')
+    assertEquals({ amy_handle: (6, 'busy', 'Hiding from the barman') },
+        event.args[0])
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    # Signal each update at once, so that duplicates can't merely be merged
+    # into the same batch.
+    set_haze_environment(HAZE_PRESENCE_DELAY='0')
+    exec_test(test)
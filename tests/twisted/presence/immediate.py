@@ -0,0 +1,14 @@
+"""
+Test that with HAZE_PRESENCE_DELAY=0, each presence change is signalled as
+soon as it arrives.
+"""
+
+from hazetest import exec_test, set_haze_environment
+import batching
+
+def test(q, bus, conn, stream):
+    batching.test(q, bus, conn, stream, immediate=True)
+
+if __name__ == '__main__':
+    set_haze_environment(HAZE_PRESENCE_DELAY='0')
+    exec_test(test)
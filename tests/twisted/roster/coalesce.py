@@ -0,0 +1,67 @@
+"""
+Test that changes to the contact list are signalled in batches, rather than
+one contact at a time, and that the batches are bounded in size.
+"""
+
+from twisted.words.protocols.jabber.client import IQ
+
+from servicetest import assertEquals, EventPattern
+from hazetest import exec_test, sync_stream
+import constants as cs
+
+# Each contact is two changes (being added, and joining a group), so this is
+# several times as many as Haze will queue before flushing.
+N_CONTACTS = 2500
+MAX_PENDING_CHANGES = 1000
+
+def push_roster(stream, jids):
+    iq = IQ(stream, 'set')
+    query = iq.addElement(('jabber:iq:roster', 'query'))
+
+    for jid in jids:
+        item = query.addElement('item')
+        item['jid'] = jid
+        item['subscription'] = 'both'
+        item.addElement('group', content='Lots')
+
+    stream.send(iq)
+
+def test(q, bus, conn, stream):
+    # A few contacts at once are signalled together.
+    few = ['amy@foo.com', 'bob@foo.com', 'che@foo.com']
+    push_roster(stream, few)
+
+    e = q.expect('dbus-signal', signal='ContactsChanged')
+    assertEquals(set(few),
+        set(conn.InspectHandles(cs.HT_CONTACT, e.args[0].keys())))
+    assertEquals([], e.args[1])
+
+    e = q.expect('dbus-signal', signal='GroupsChanged')
+    assertEquals(set(few), set(conn.InspectHandles(cs.HT_CONTACT, e.args[0])))
+    assertEquals((['Lots'], []), (e.args[1], e.args[2]))
+
+    # A large roster push comes out in a few batches, none of them too big.
+    many = ['contact%d@foo.com' % i for i in range(N_CONTACTS)]
+    push_roster(stream, many)
+
+    seen = set()
+    batches = 0
+
+    while len(seen) < N_CONTACTS:
+        e = q.expect('dbus-signal', signal='ContactsChanged')
+        assert len(e.args[0]) <= MAX_PENDING_CHANGES, len(e.args[0])
+        seen.update(e.args[0].keys())
+        batches += 1
+
+    assertEquals(set(many), set(conn.InspectHandles(cs.HT_CONTACT, seen)))
+
+    # Queueing at most MAX_PENDING_CHANGES changes means at least this many
+    # batches; more may be needed if Haze takes longer than the 250 ms it
+    # will hold changes back for, but nothing like one per contact.
+    assert batches >= 2 * N_CONTACTS / MAX_PENDING_CHANGES, batches
+    assert batches < N_CONTACTS / 50, batches
+
+    sync_stream(q, stream)
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,74 @@
+"""
+Test fetching only the changes to the contact list since a given version,
+with the draft ContactListChanges interface.
+"""
+
+import dbus
+
+from twisted.words.protocols.jabber.client import IQ
+
+from servicetest import assertEquals, assertContains
+from hazetest import exec_test
+import constants as cs
+
+def push_roster(stream, jid, subscription):
+    iq = IQ(stream, 'set')
+    query = iq.addElement(('jabber:iq:roster', 'query'))
+    item = query.addElement('item')
+    item['jid'] = jid
+    item['subscription'] = subscription
+    stream.send(iq)
+
+def test(q, bus, conn, stream):
+    assertContains(cs.CONN_IFACE_CONTACT_LIST_CHANGES,
+        conn.Properties.Get(cs.CONN, 'Interfaces'))
+    changes = dbus.Interface(conn.object, cs.CONN_IFACE_CONTACT_LIST_CHANGES)
+
+    # The roster is empty, and a client which has seen nothing gets it all.
+    first, complete, changed, removed = changes.GetContactListChanges(0)
+    assertEquals((True, {}, []), (complete, changed, removed))
+
+    amy, bob = conn.RequestHandles(cs.HT_CONTACT,
+        ['amy@foo.com', 'bob@foo.com'])
+
+    push_roster(stream, 'amy@foo.com', 'both')
+    q.expect('dbus-signal', signal='ContactsChanged',
+        predicate=lambda e: amy in e.args[0])
+    push_roster(stream, 'bob@foo.com', 'both')
+    q.expect('dbus-signal', signal='ContactsChanged',
+        predicate=lambda e: bob in e.args[0])
+
+    second, complete, changed, removed = changes.GetContactListChanges(first)
+    assert second > first, (first, second)
+    assertEquals(False, complete)
+    assertEquals(set([amy, bob]), set(changed.keys()))
+    assertEquals([], removed)
+    assertEquals(conn.ContactList.GetContactListAttributes([], False)[amy][
+            cs.CONN_IFACE_CONTACT_LIST + '/subscribe'],
+        changed[amy][0])
+
+    # Nothing has happened since.
+    assertEquals((second, False, {}, []),
+        changes.GetContactListChanges(second))
+
+    push_roster(stream, 'bob@foo.com', 'remove')
+    q.expect('dbus-signal', signal='ContactsChanged',
+        predicate=lambda e: e.args[1] == [bob])
+
+    third, complete, changed, removed = changes.GetContactListChanges(second)
+    assert third > second, (second, third)
+    assertEquals((False, {}, [bob]), (complete, changed, removed))
+
+    # Changes since an earlier version include everything after it.
+    _, complete, changed, removed = changes.GetContactListChanges(first)
+    assertEquals((False, [amy], [bob]), (complete, changed.keys(), removed))
+
+    # A version the connection never gave out gets the whole list.
+    _, complete, changed, removed = changes.GetContactListChanges(third + 1)
+    assertEquals((True, [amy], []), (complete, changed.keys(), removed))
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    exec_test(test)
@@ -0,0 +1,78 @@
+"""
+Test that, with a state directory, decisions about who may see our presence
+are remembered when Haze is restarted.
+"""
+
+import os
+import shutil
+import tempfile
+
+from twisted.words.xish import domish
+
+from servicetest import assertEquals, EventPattern, call_async
+from hazetest import (exec_test, set_haze_environment,
+    make_another_connection, wait_for_haze_to_exit, expect_kinda_connected)
+import constants as cs
+
+def request_subscription(stream, jid, message):
+    presence = domish.Element(('jabber:client', 'presence'))
+    presence['from'] = jid
+    presence['type'] = 'subscribe'
+    presence.addElement('status', content=message)
+    stream.send(presence)
+
+def get_publish_states(conn, jids):
+    handles = conn.RequestHandles(cs.HT_CONTACT, jids)
+    attrs = conn.ContactList.GetContactListAttributes([], False)
+
+    return [(attrs[h][cs.CONN_IFACE_CONTACT_LIST + '/publish'],
+            attrs[h].get(cs.CONN_IFACE_CONTACT_LIST + '/publish-request', ''))
+        for h in handles]
+
+def test(q, bus, conn, stream):
+    alice, bob = conn.RequestHandles(cs.HT_CONTACT,
+        ['alice@wonderland.lit', 'bob@wonderland.lit'])
+
+    request_subscription(stream, 'alice@wonderland.lit', 'friend me')
+    request_subscription(stream, 'bob@wonderland.lit', 'let me in')
+    q.expect('dbus-signal', signal='ContactsChanged',
+        predicate=lambda e: bob in e.args[0])
+
+    call_async(q, conn.ContactList, 'AuthorizePublication', [alice])
+    q.expect_many(
+            EventPattern('stream-presence', presence_type='subscribed',
+                to='alice@wonderland.lit'),
+            EventPattern('dbus-return', method='AuthorizePublication'),
+            )
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+    wait_for_haze_to_exit(q, bus)
+
+    assert os.path.exists(os.path.join(os.environ['HAZE_STATE_DIR'],
+        'publish.ini'))
+
+    # A new Haze answers from what the last one remembered, without waiting
+    # for the server to say anything.
+    conn, stream = make_another_connection(q, bus)
+    conn.Connect()
+    expect_kinda_connected(q)
+
+    assertEquals([
+        (cs.SUBSCRIPTION_STATE_YES, ''),
+        (cs.SUBSCRIPTION_STATE_ASK, 'let me in'),
+        ], get_publish_states(conn,
+            ['alice@wonderland.lit', 'bob@wonderland.lit']))
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    state_dir = tempfile.mkdtemp()
+    os.environ['HAZE_STATE_DIR'] = state_dir
+    set_haze_environment(HAZE_STATE_DIR=state_dir)
+
+    try:
+        exec_test(test)
+    finally:
+        shutil.rmtree(state_dir)
@@ -0,0 +1,99 @@
+"""
+Test that when an account reconnects, the contacts which are still on its
+roster aren't announced again, but those which have gone are removed.
+"""
+
+from servicetest import assertEquals, EventPattern, call_async
+from hazetest import (exec_test, JabberXmlStream, set_haze_environment,
+    make_another_connection)
+import constants as cs
+import ns
+
+def receive_roster(q, stream, contacts):
+    event = q.expect('stream-iq', query_ns=ns.ROSTER)
+    event.stanza['type'] = 'result'
+
+    for jid, group in contacts:
+        item = event.query.addElement('item')
+        item['jid'] = jid
+        item['subscription'] = 'both'
+        item.addElement('group', content=group)
+
+    stream.send(event.stanza)
+
+def get_roster(conn):
+    attrs = conn.ContactList.GetContactListAttributes(
+        [cs.CONN_IFACE_CONTACT_GROUPS], False)
+    return dict([(conn.InspectHandles(cs.HT_CONTACT, [h])[0],
+            sorted(a[cs.CONN_IFACE_CONTACT_GROUPS + '/groups']))
+        for h, a in attrs.iteritems()])
+
+def connect(q, conn, stream, contacts):
+    conn.Connect()
+    q.expect_many(
+            EventPattern('dbus-signal', signal='StatusChanged',
+                args=[cs.CONN_STATUS_CONNECTING, cs.CSR_REQUESTED]),
+            EventPattern('stream-authenticated'),
+            )
+    receive_roster(q, stream, contacts)
+    q.expect('dbus-signal', signal='StatusChanged',
+            args=[cs.CONN_STATUS_CONNECTED, cs.CSR_REQUESTED])
+
+def test(q, bus, conn, stream):
+    connect(q, conn, stream, [
+        ('amy@foo.com', 'Friends'),
+        ('bob@foo.com', 'Friends'),
+        ('dan@foo.com', 'Friends'),
+        ])
+    assertEquals({
+        'amy@foo.com': ['Friends'],
+        'bob@foo.com': ['Friends'],
+        'dan@foo.com': ['Friends'],
+        }, get_roster(conn))
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+    # Since the last connection, Bob has moved group, Chris has been added,
+    # and Dan has been removed.
+    conn, stream = make_another_connection(q, bus, protocol=JabberXmlStream)
+    connect(q, conn, stream, [
+        ('amy@foo.com', 'Friends'),
+        ('bob@foo.com', 'Colleagues'),
+        ('chris@foo.com', 'Friends'),
+        ])
+
+    # Until the roster has settled, Dan is assumed to still be there.
+    assertEquals({
+        'amy@foo.com': ['Friends'],
+        'bob@foo.com': ['Colleagues'],
+        'chris@foo.com': ['Friends'],
+        'dan@foo.com': ['Friends'],
+        }, get_roster(conn))
+
+    dan = conn.RequestHandles(cs.HT_CONTACT, ['dan@foo.com'])[0]
+
+    # Nobody else is announced again, and Dan is removed.
+    added = [EventPattern('dbus-signal', signal='ContactsChanged',
+        path=conn.object_path, predicate=lambda e: e.args[0] != {})]
+    q.forbid_events(added)
+
+    q.expect('dbus-signal', signal='ContactsChanged', path=conn.object_path,
+        args=[{}, [dan]])
+
+    q.unforbid_events(added)
+
+    assertEquals({
+        'amy@foo.com': ['Friends'],
+        'bob@foo.com': ['Colleagues'],
+        'chris@foo.com': ['Friends'],
+        }, get_roster(conn))
+
+    conn.Disconnect()
+    q.expect('dbus-signal', signal='StatusChanged', args=[2, 1])
+
+if __name__ == '__main__':
+    # The last roster is only kept in memory, so Haze mustn't exit when the
+    # first connection goes away.
+    set_haze_environment(HAZE_PERSIST='1')
+    exec_test(test, protocol=JabberXmlStream, do_connect=False)